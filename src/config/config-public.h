@@ -1,7 +1,9 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
+#include <fcitx-config/rawconfig.h>
 #include <fcitx/instance.h>
 
 /// Get a json document describing the current config for uri.
@@ -26,9 +28,38 @@
 /// }
 std::string getInstanceConfig(const std::string &uri, fcitx::Instance* instance);
 
-/// This function applies jsonPatch to the current "Value" for config
+/// Raw copies of a config, taken on the main loop so that the json document
+/// can be built on another thread.
+struct CapturedConfig {
+    fcitx::RawConfig description;
+    fcitx::RawConfig value;
+    // Set if there is no config for the uri.
+    std::string error;
+};
+
+/// Capture the config for uri, must be called on the main loop.
+CapturedConfig captureInstanceConfig(const std::string &uri, fcitx::Instance* instance);
+
+/// Build the json document described by getInstanceConfig. Thread-safe.
+std::string capturedConfigToJson(const CapturedConfig &captured);
+
+/// Parse a json document into a RawConfig without building a json tree.
+///
+/// The document must be an object whose values are strings, numbers,
+/// booleans or objects of the same kind, e.g. {"Tcp": {"Port": 12345}}.
+/// Returns false and sets error otherwise. Thread-safe.
+bool parseConfigJson(const char* data, size_t sz, fcitx::RawConfig& config, std::string& error);
+
+/// List the uris of all configs that can be got, must be called on the main
+/// loop.
+///
+/// Configs of addons that are not loaded are skipped, so that listing does not
+/// load on demand addons.
+std::vector<std::string> listConfigUris(fcitx::Instance* instance);
+
+/// This function applies the parsed patch to the current "Value" for config
 /// uri.
 ///
 /// This function updates the current value and then reload the config.
-bool setInstanceConfig(const std::string& uri, const char* data, size_t sz, fcitx::Instance* instance);
+bool setInstanceConfig(const std::string& uri, const fcitx::RawConfig& config, fcitx::Instance* instance);
 
@@ -18,80 +18,123 @@ using namespace std::literals::string_literals;
 
 static nlohmann::json &jsonLocate(nlohmann::json &j, const std::string &group,
                                   const std::string &option);
-static nlohmann::json configToJson(const fcitx::Configuration &config);
+static nlohmann::json configToJson(const fcitx::RawConfig &description,
+                                   const fcitx::RawConfig &value);
 static nlohmann::json configValueToJson(const fcitx::RawConfig &config);
 static nlohmann::json configSpecToJson(const fcitx::RawConfig &config);
-static nlohmann::json configSpecToJson(const fcitx::Configuration &config);
 static void mergeSpecAndValue(nlohmann::json &specJson,
                               const nlohmann::json &valueJson);
-static fcitx::RawConfig jsonToRawConfig(const nlohmann::json &);
 static std::tuple<std::string, std::string>
 parseAddonUri(const std::string &uri);
 
-std::string getInstanceConfig(const std::string &uri, fcitx::Instance* instance) {
+CapturedConfig captureInstanceConfig(const std::string &uri,
+                                     fcitx::Instance *instance) {
     FCITX_DEBUG() << "getConfig " << uri;
-    return [&uri, instance]() -> nlohmann::json {
+    CapturedConfig captured;
+    auto *config = [&uri, instance,
+                    &error = captured.error]() -> const fcitx::Configuration * {
         if (uri == globalConfigPath) {
-            auto &config = instance->globalConfig().config();
-            return configToJson(config);
+            return &instance->globalConfig().config();
         } else if (fcitx::stringutils::startsWith(uri,
                                                   addonConfigPrefix)) {
             auto [addonName, subPath] = parseAddonUri(uri);
             auto *addonInfo = instance->addonManager().addonInfo(addonName);
             if (!addonInfo) {
-                return {{"ERROR",
-                         "Addon \""s + addonName + "\" does not exist"}};
+                error = "Addon \""s + addonName + "\" does not exist";
+                return nullptr;
             } else if (!addonInfo->isConfigurable()) {
-                return {{"ERROR", "Addon \""s + addonName +
-                                      "\" is not configurable"}};
+                error = "Addon \""s + addonName + "\" is not configurable";
+                return nullptr;
             }
             auto *addon = instance->addonManager().addon(addonName, true);
             if (!addon) {
-                return {{"ERROR", "Failed to get config for addon \""s +
-                                      addonName + "\""}};
+                error = "Failed to get config for addon \""s + addonName +
+                        "\"";
+                return nullptr;
             }
             auto *config = subPath.empty()
                                ? addon->getConfig()
                                : addon->getSubConfig(subPath);
             if (!config) {
-                return {{"ERROR", "Failed to get config for addon \""s +
-                                      addonName + "\""}};
+                error = "Failed to get config for addon \""s + addonName +
+                        "\"";
             }
-            return configToJson(*config);
+            return config;
         } else if (fcitx::stringutils::startsWith(uri, imConfigPrefix)) {
             auto imName = uri.substr(sizeof(imConfigPrefix) - 1);
             auto *entry =
                 instance->inputMethodManager().entry(imName);
             if (!entry) {
-                return {{"ERROR", "Input method \""s + imName +
-                                      "\" doesn't exist"}};
+                error = "Input method \""s + imName + "\" doesn't exist";
+                return nullptr;
             }
             if (!entry->isConfigurable()) {
-                return {{"ERROR", "Input method \""s + imName +
-                                      "\" is not configurable"}};
+                error = "Input method \""s + imName +
+                        "\" is not configurable";
+                return nullptr;
             }
             auto *engine = instance->inputMethodEngine(imName);
             if (!engine) {
-                return {{"ERROR",
-                         "Failed to get engine for input method \""s +
-                             imName + "\""}};
+                error = "Failed to get engine for input method \""s +
+                        imName + "\"";
+                return nullptr;
             }
             auto *config = engine->getConfigForInputMethod(*entry);
             if (!config) {
-                return {{"ERROR",
-                         "Failed to get config for input method \""s +
-                             imName + "\""}};
+                error = "Failed to get config for input method \""s +
+                        imName + "\"";
             }
-            return configToJson(*config);
+            return config;
         } else {
-            return {{"ERROR", "Bad config URI \""s + uri + "\""}};
+            error = "Bad config URI \""s + uri + "\"";
+            return nullptr;
         }
-    }().dump();
+    }();
+    if (config) {
+        // The only work that has to be done on the main loop.
+        config->dumpDescription(captured.description);
+        config->save(captured.value);
+    }
+    return captured;
 }
 
-bool setInstanceConfig(const std::string& uri, const char* data, size_t sz, fcitx::Instance* instance) {
+std::string capturedConfigToJson(const CapturedConfig &captured) {
+    if (!captured.error.empty()) {
+        return nlohmann::json{{"ERROR", captured.error}}.dump();
+    }
+    return configToJson(captured.description, captured.value).dump();
+}
+
+std::string getInstanceConfig(const std::string &uri, fcitx::Instance* instance) {
+    return capturedConfigToJson(captureInstanceConfig(uri, instance));
+}
+
+std::vector<std::string> listConfigUris(fcitx::Instance *instance) {
+    std::vector<std::string> uris{globalConfigPath};
+    auto &addonManager = instance->addonManager();
+    for (auto category :
+         {fcitx::AddonCategory::InputMethod, fcitx::AddonCategory::Frontend,
+          fcitx::AddonCategory::Loader, fcitx::AddonCategory::Module,
+          fcitx::AddonCategory::UI}) {
+        for (const auto &name : addonManager.addonNames(category)) {
+            const auto *info = addonManager.addonInfo(name);
+            if (info && info->isConfigurable() && addonManager.addon(name)) {
+                uris.push_back(addonConfigPrefix + name);
+            }
+        }
+    }
+    instance->inputMethodManager().foreachEntries(
+        [&uris, &addonManager](const fcitx::InputMethodEntry &entry) {
+            if (entry.isConfigurable() && addonManager.addon(entry.addon())) {
+                uris.push_back(imConfigPrefix + entry.uniqueName());
+            }
+            return true;
+        });
+    return uris;
+}
+
+bool setInstanceConfig(const std::string& uri, const fcitx::RawConfig& config, fcitx::Instance* instance) {
     FCITX_DEBUG() << "setConfig " << uri;
-    auto config = jsonToRawConfig(nlohmann::json::parse(data, data + sz));
     if (uri == globalConfigPath) {
         auto &gc = instance->globalConfig();
         gc.load(config, true);
@@ -135,26 +178,103 @@ bool setInstanceConfig(const std::string& uri, const char* data, size_t sz, fcit
     }
 }
 
-void jsonFillRawConfigValues(const nlohmann::json &j,
-                             fcitx::RawConfig &config) {
-    if (j.is_string()) {
-        config = j.get<std::string>();
-        return;
+namespace {
+
+// Fills a RawConfig while the document is being parsed. Only objects and
+// scalars are accepted, anything else stops the parser.
+class RawConfigSax : public nlohmann::json_sax<nlohmann::json> {
+public:
+    explicit RawConfigSax(fcitx::RawConfig &root) : root_(root) {}
+
+    const std::string &error() const { return error_; }
+
+    bool null() override { return unexpected("null"); }
+    bool binary(binary_t &) override { return unexpected("binary"); }
+    bool start_array(std::size_t) override { return unexpected("array"); }
+    bool end_array() override { return unexpected("array"); }
+
+    // Scalars are stored the way fcitx marshalls them.
+    bool boolean(bool val) override { return value(val ? "True" : "False"); }
+    bool number_integer(number_integer_t val) override {
+        return value(std::to_string(val));
+    }
+    bool number_unsigned(number_unsigned_t val) override {
+        return value(std::to_string(val));
+    }
+    bool number_float(number_float_t, const string_t &raw) override {
+        return value(raw);
+    }
+    bool string(string_t &val) override { return value(std::move(val)); }
+
+    bool start_object(std::size_t) override {
+        if (stack_.size() >= MaxDepth) {
+            // Destroying a deep RawConfig tree recurses as deep.
+            error_ = "Objects nested deeper than " +
+                     std::to_string(MaxDepth) + " levels";
+            return false;
+        }
+        if (stack_.empty()) {
+            stack_.push_back(&root_);
+        } else {
+            stack_.push_back(stack_.back()->get(key_, true).get());
+        }
+        return true;
+    }
+
+    bool key(string_t &val) override {
+        key_ = std::move(val);
+        return true;
     }
-    if (j.is_object()) {
-        for (const auto& [key, subJson] : j.items()) {
-            auto subConfig = config.get(key, true);
-            jsonFillRawConfigValues(subJson, *subConfig);
+
+    bool end_object() override {
+        stack_.pop_back();
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string &,
+                     const nlohmann::json::exception &ex) override {
+        error_ = ex.what();
+        return false;
+    }
+
+private:
+    // Far more than any fcitx config needs.
+    static constexpr std::size_t MaxDepth = 32;
+
+    bool value(std::string val) {
+        if (stack_.empty()) {
+            return unexpected("value");
         }
-        return;
+        stack_.back()->get(key_, true)->setValue(std::move(val));
+        return true;
     }
-    FCITX_FATAL() << "Unknown value json: " << j.dump();
-}
 
-fcitx::RawConfig jsonToRawConfig(const nlohmann::json &j) {
-    fcitx::RawConfig config;
-    jsonFillRawConfigValues(j, config);
-    return config;
+    bool unexpected(const char *what) {
+        error_ = "Unexpected "s + what;
+        if (!stack_.empty()) {
+            error_ += " for \"" + key_ + "\"";
+        } else {
+            error_ += ", expecting an object";
+        }
+        return false;
+    }
+
+    fcitx::RawConfig &root_;
+    std::vector<fcitx::RawConfig *> stack_;
+    std::string key_;
+    std::string error_;
+};
+
+} // namespace
+
+bool parseConfigJson(const char *data, size_t sz, fcitx::RawConfig &config,
+                     std::string &error) {
+    RawConfigSax sax(config);
+    if (!nlohmann::json::sax_parse(data, data + sz, &sax)) {
+        error = sax.error();
+        return false;
+    }
+    return true;
 }
 
 nlohmann::json &jsonLocate(nlohmann::json &j, const std::string &groupPath,
@@ -193,12 +313,6 @@ nlohmann::json configValueToJson(const fcitx::RawConfig &config) {
     return j;
 }
 
-nlohmann::json configValueToJson(const fcitx::Configuration &config) {
-    fcitx::RawConfig raw;
-    config.save(raw);
-    return configValueToJson(raw);
-}
-
 nlohmann::json configSpecToJson(const fcitx::RawConfig &config) {
     // first level  -> Path1$Path2$...$Path_n$ConfigType
     // second level -> OptionName
@@ -234,17 +348,12 @@ void mergeSpecAndValue(nlohmann::json &specJson,
     }
 }
 
-nlohmann::json configSpecToJson(const fcitx::Configuration &config) {
-    fcitx::RawConfig rawDesc;
-    config.dumpDescription(rawDesc);
-    return configSpecToJson(rawDesc);
-}
-
-nlohmann::json configToJson(const fcitx::Configuration &config) {
+nlohmann::json configToJson(const fcitx::RawConfig &description,
+                            const fcitx::RawConfig &value) {
     // specJson contains config definitions
-    auto specJson = configSpecToJson(config);
+    auto specJson = configSpecToJson(description);
     // valueJson contains actual values that user could change
-    auto valueJson = configValueToJson(config);
+    auto valueJson = configValueToJson(value);
     mergeSpecAndValue(specJson, valueJson);
     return specJson;
 }
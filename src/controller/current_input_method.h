@@ -4,7 +4,27 @@
 
 #include "nlohmann/json.hpp"
 
+#include "state_snapshot.h"
+
 inline nlohmann::json current_input_method(const std::string&, fcitx::Instance* instance) {
     return {{ "input_method", instance->currentInputMethod() }};
 }
 
+inline nlohmann::json current_input_method(const std::string&, const StateSnapshot& state) {
+    return {{ "input_method", state.input_method }};
+}
+
+inline nlohmann::json current_input_method_group(const std::string&, const StateSnapshot& state) {
+    return {{ "group", state.group }};
+}
+
+inline nlohmann::json focused_input_context(const std::string&, const StateSnapshot& state) {
+    if (state.uuid.empty()) return {{ "focused", false }};
+    return {
+        { "focused", true },
+        { "program", state.program },
+        { "frontend", state.frontend },
+        { "uuid", state.uuid },
+        { "input_method", state.input_method },
+    };
+}
@@ -1,23 +1,41 @@
 #pragma once
 
+#include <optional>
 #include <string>
 
 #include "fcitx/instance.h"
 #include "nlohmann/json.hpp"
 
 #include "current_input_method.h"
+#include "state_snapshot.h"
 
-inline nlohmann::json handle_controller_request(const std::string& path, fcitx::Instance* instance) {
+inline std::pair<std::string, std::string> split_controller_path(const std::string& path) {
     auto it = std::find(path.begin(), path.end(), '/');
     std::string method{path.begin(), it};
     if (it != path.end()) it++;
-    std::string params{it, path.end()};
+    return {method, std::string{it, path.end()}};
+}
+
+/// Read-only methods served from a state snapshot, safe to call from any
+/// thread. Returns nullopt if the method needs the main loop.
+inline std::optional<nlohmann::json> handle_snapshot_request(const std::string& path, const StateSnapshot& state) {
+    auto [method, params] = split_controller_path(path);
+    static const std::unordered_map<std::string, std::function<nlohmann::json(const std::string&, const StateSnapshot& state)>> routes{
+        {"current_input_method", [](const std::string& p, const StateSnapshot& s) { return current_input_method(p, s); }},
+        {"current_input_method_group", current_input_method_group},
+        {"focused_input_context", focused_input_context},
+    };
+    auto itt = routes.find(method);
+    if (itt == routes.end()) return std::nullopt;
+    return itt->second(params, state);
+}
+
+inline nlohmann::json handle_controller_request(const std::string& path, fcitx::Instance* instance) {
+    auto [method, params] = split_controller_path(path);
     static const std::unordered_map<std::string, std::function<nlohmann::json(const std::string&, fcitx::Instance* instance)>> routes{
-        {"current_input_method", current_input_method},
-        // {"current_input_method_group", current_input_method_group},
+        {"current_input_method", [](const std::string& p, fcitx::Instance* i) { return current_input_method(p, i); }},
     };
     auto itt = routes.find(method);
     if (itt == routes.end()) return {{ "ERROR", "no such method: " + method }};
     return itt->second(params, instance);
 }
-
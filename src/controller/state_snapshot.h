@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "fcitx/inputcontext.h"
+#include "fcitx/inputmethodmanager.h"
+#include "fcitx/instance.h"
+
+/// Hot read-only state, captured on the main loop and read on the I/O
+/// threads without touching fcitx.
+struct StateSnapshot {
+    std::string input_method;
+    std::string group;
+    // The following are empty if no input context has focus.
+    std::string program;
+    std::string frontend;
+    std::string uuid;
+};
+
+/// Holds the latest snapshot, written by the main loop only.
+///
+/// Snapshots are immutable once published; a reader keeps the one it loaded
+/// alive for as long as it needs it.
+class StateSnapshotCell {
+public:
+    std::shared_ptr<const StateSnapshot> load() const {
+#ifdef __cpp_lib_atomic_shared_ptr
+        return ptr_.load(std::memory_order_acquire);
+#else
+        return std::atomic_load_explicit(&ptr_, std::memory_order_acquire);
+#endif
+    }
+
+    void store(std::shared_ptr<const StateSnapshot> snapshot) {
+#ifdef __cpp_lib_atomic_shared_ptr
+        ptr_.store(std::move(snapshot), std::memory_order_release);
+#else
+        std::atomic_store_explicit(&ptr_, std::move(snapshot),
+                                   std::memory_order_release);
+#endif
+    }
+
+private:
+#ifdef __cpp_lib_atomic_shared_ptr
+    std::atomic<std::shared_ptr<const StateSnapshot>> ptr_;
+#else
+    std::shared_ptr<const StateSnapshot> ptr_;
+#endif
+};
+
+inline std::string ic_uuid_str(const fcitx::InputContext *ic) {
+    std::ostringstream ss;
+    ss << std::hex << std::setfill('0');
+    for (auto v : ic->uuid()) {
+        ss << std::setw(2) << static_cast<int>(v);
+    }
+    return ss.str();
+}
+
+/// Must be called on the main loop. focused may be null.
+inline std::shared_ptr<const StateSnapshot>
+capture_state(fcitx::Instance *instance, fcitx::InputContext *focused) {
+    auto snapshot = std::make_shared<StateSnapshot>();
+    snapshot->group = instance->inputMethodManager().currentGroup().name();
+    if (focused) {
+        snapshot->input_method = instance->inputMethod(focused);
+        snapshot->program = focused->program();
+        snapshot->frontend = focused->frontendName();
+        snapshot->uuid = ic_uuid_str(focused);
+    } else {
+        snapshot->input_method = instance->currentInputMethod();
+    }
+    return snapshot;
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/asio/io_context.hpp>
+#include <fcitx-utils/event.h>
+#include <fcitx-utils/log.h>
+
+namespace fcitx {
+
+/// Runs an io_context on the fcitx event loop instead of a server thread.
+///
+/// The io_context is polled without blocking whenever a socket becomes
+/// ready for an operation asio waits on, and after work was posted to it
+/// from the main loop. Sockets are only watched while such an operation is
+/// pending, so unread data or a writable socket nobody writes to never
+/// wakes the loop. Timers are not visible from outside asio, so whoever
+/// arms one asks for a wakeup with wakeAfter(), or sets a heartbeat on the
+/// session for timers armed inside Beast. An idle server never wakes up.
+class IoPump {
+public:
+    IoPump(EventLoop &loop, boost::asio::io_context &ioc)
+        : loop_(loop), ioc_(ioc) {
+        defer_ = loop_.addDeferEvent([this](EventSource *) {
+            clearRetired();
+            poll();
+            return true;
+        });
+        defer_->setEnabled(false);
+        timer_ = loop_.addTimeEvent(CLOCK_MONOTONIC, 0, 0,
+                                    [this](EventSourceTime *, uint64_t) {
+                                        poll();
+                                        return true;
+                                    });
+        timer_->setEnabled(false);
+    }
+
+    // Every Watch must be gone by now.
+    ~IoPump() { clearRetired(); }
+
+private:
+    struct State;
+
+public:
+    /// Keeps the fd readiness of one async operation watched while alive.
+    /// Captured by the completion handler, so that the fd is only watched
+    /// while asio waits on it.
+    class Interest {
+    public:
+        Interest() = default;
+        Interest(Interest &&other) noexcept
+            : state_(std::move(other.state_)), flag_(other.flag_) {}
+        Interest &operator=(Interest &&other) noexcept {
+            if (this != &other) {
+                release();
+                state_ = std::move(other.state_);
+                flag_ = other.flag_;
+            }
+            return *this;
+        }
+        ~Interest() { release(); }
+
+    private:
+        friend class IoPump;
+        Interest(std::shared_ptr<State> state, IOEventFlag flag)
+            : state_(std::move(state)), flag_(flag) {
+            if (state_) {
+                state_->add(flag_, 1);
+            }
+        }
+        void release() {
+            if (state_) {
+                state_->add(flag_, -1);
+                state_.reset();
+            }
+        }
+
+        std::shared_ptr<State> state_;
+        IOEventFlag flag_ = IOEventFlag::In;
+    };
+
+    /// The socket of one session. It is watched through a duplicate of its
+    /// fd, so a closed socket whose fd number gets reused by a new one never
+    /// shares its watcher. Empty when the pump is not running.
+    class Watch {
+    public:
+        Watch() = default;
+
+        /// Watch for flag until the returned interest is destroyed.
+        Interest track(IOEventFlag flag) const {
+            return Interest{state_, flag};
+        }
+
+        /// Poll at least once per interval after the last poll while the
+        /// session lives, for timeouts it cannot report with wakeAfter().
+        void setHeartbeat(std::chrono::microseconds interval) {
+            if (state_) {
+                state_->pump->setHeartbeat(*state_, interval);
+            }
+        }
+
+    private:
+        friend class IoPump;
+        explicit Watch(std::shared_ptr<State> state)
+            : state_(std::move(state)) {}
+
+        std::shared_ptr<State> state_;
+    };
+
+    Watch watch(int fd) {
+        int dupFd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (dupFd < 0) {
+            FCITX_WARN() << "WebServer: cannot watch socket: "
+                         << std::strerror(errno);
+            return {};
+        }
+        return Watch{std::make_shared<State>(this, dupFd)};
+    }
+
+    /// Poll soon, after posting to the io_context from the main loop.
+    void kick() { defer_->setOneShot(); }
+
+    /// Poll once delay has passed, for an asio timer armed with it.
+    void wakeAfter(std::chrono::microseconds delay) {
+        wakes_.push(now(CLOCK_MONOTONIC) + delay.count() + TimerSlack);
+        armTimer();
+    }
+
+private:
+    // Lets asio see its timer as expired when polled, in microseconds.
+    static constexpr uint64_t TimerSlack = 1000;
+
+    struct State {
+        State(IoPump *pump, int fd) : pump(pump), fd(fd) {}
+        ~State() {
+            if (heartbeat) {
+                pump->heartbeats_.erase(*heartbeat);
+                pump->armTimer();
+            }
+            pump->retire(std::move(source), fd);
+        }
+
+        void add(IOEventFlag flag, int delta) {
+            (flag == IOEventFlag::In ? reads : writes) += delta;
+            if (!reads && !writes) {
+                if (source) {
+                    source->setEnabled(false);
+                }
+                return;
+            }
+            IOEventFlags flags;
+            if (reads) {
+                flags |= IOEventFlag::In;
+            }
+            if (writes) {
+                flags |= IOEventFlag::Out;
+            }
+            if (!source) {
+                source = pump->loop_.addIOEvent(
+                    fd, flags,
+                    [pump = pump](EventSourceIO *, int, IOEventFlags) {
+                        pump->poll();
+                        return true;
+                    });
+                return;
+            }
+            source->setEvents(flags);
+            source->setEnabled(true);
+        }
+
+        IoPump *pump;
+        int fd;
+        std::unique_ptr<EventSourceIO> source;
+        int reads = 0;
+        int writes = 0;
+        std::optional<std::multiset<uint64_t>::iterator> heartbeat;
+    };
+
+    void setHeartbeat(State &state, std::chrono::microseconds interval) {
+        if (state.heartbeat) {
+            heartbeats_.erase(*state.heartbeat);
+        }
+        state.heartbeat = heartbeats_.insert(interval.count() + TimerSlack);
+        armTimer();
+    }
+
+    void armTimer() {
+        auto next = std::numeric_limits<uint64_t>::max();
+        if (!wakes_.empty()) {
+            next = wakes_.top();
+        }
+        if (!heartbeats_.empty()) {
+            next = std::min(next, lastPoll_ + *heartbeats_.begin());
+        }
+        if (next == std::numeric_limits<uint64_t>::max()) {
+            timer_->setEnabled(false);
+            return;
+        }
+        timer_->setTime(next);
+        timer_->setOneShot();
+    }
+
+    // The source may be the one running poll(), close it later.
+    void retire(std::unique_ptr<EventSourceIO> source, int fd) {
+        if (source) {
+            source->setEnabled(false);
+        }
+        retired_.emplace_back(std::move(source), fd);
+        kick();
+    }
+
+    void clearRetired() {
+        for (auto &[source, fd] : retired_) {
+            source.reset();
+            ::close(fd);
+        }
+        retired_.clear();
+    }
+
+    void poll() {
+        auto start = now(CLOCK_MONOTONIC);
+        while (!wakes_.empty() && wakes_.top() <= start) {
+            wakes_.pop();
+        }
+        if (ioc_.stopped()) {
+            ioc_.restart();
+        }
+        size_t handled = 0;
+        try {
+            handled = ioc_.poll();
+        } catch (const std::exception &e) {
+            FCITX_ERROR() << "Error in WebServer: " << e.what();
+            handled = 1;
+        }
+        if (handled) {
+            // Handlers may have queued more work.
+            kick();
+        }
+        lastPoll_ = now(CLOCK_MONOTONIC);
+        armTimer();
+    }
+
+    EventLoop &loop_;
+    boost::asio::io_context &ioc_;
+    std::vector<std::pair<std::unique_ptr<EventSourceIO>, int>> retired_;
+    std::unique_ptr<EventSource> defer_;
+    std::unique_ptr<EventSourceTime> timer_;
+    // Deadlines from wakeAfter(), in CLOCK_MONOTONIC microseconds.
+    std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<>>
+        wakes_;
+    // Heartbeat intervals of the live sessions.
+    std::multiset<uint64_t> heartbeats_;
+    uint64_t lastPoll_ = 0;
+};
+
+} // namespace fcitx
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+#include <fcitx-utils/eventdispatcher.h>
+#include <fcitx-utils/log.h>
+
+#include "../trace/tracer.h"
+
+namespace fcitx {
+
+/// Work posted from the web server threads to the fcitx main loop.
+///
+/// The dispatcher is signalled at most once until the queue is drained, so a
+/// burst of requests costs a single wakeup of the main loop. Queued jobs are
+/// run in slices bounded by a time budget; when a slice runs out of time the
+/// rest is rescheduled, letting the event loop handle pending key events
+/// first.
+class MainLoopJobQueue {
+public:
+    using Job = std::function<void()>;
+    using Clock = std::chrono::steady_clock;
+
+    MainLoopJobQueue(EventDispatcher &dispatcher,
+                     std::chrono::microseconds sliceBudget, Tracer &tracer)
+        : dispatcher_(dispatcher), sliceBudget_(sliceBudget),
+          tracer_(tracer) {}
+
+    /// Queue a job, may be called from any thread.
+    void push(Job job) {
+        {
+            std::lock_guard lg{mut_};
+            if (shutdown_) {
+                // Dropping the job here breaks any promise it owns, which
+                // unblocks a waiting caller instead of leaving it hanging.
+                return;
+            }
+            jobs_.push_back(
+                {std::move(job), tracer_.enabled() ? Tracer::now() : 0});
+            if (signalled_) {
+                return;
+            }
+            signalled_ = true;
+        }
+        dispatcher_.schedule([this]() { drain(); });
+    }
+
+    /// Drop pending jobs and refuse new ones.
+    void shutdown() {
+        std::deque<Entry> dropped;
+        std::lock_guard lg{mut_};
+        shutdown_ = true;
+        dropped.swap(jobs_);
+    }
+
+    /// Accept jobs again after shutdown().
+    void reopen() {
+        std::lock_guard lg{mut_};
+        shutdown_ = false;
+    }
+
+    size_t pending() const {
+        std::lock_guard lg{mut_};
+        return jobs_.size();
+    }
+
+private:
+    // Runs on the main loop.
+    void drain() {
+        const auto deadline = Clock::now() + sliceBudget_;
+        std::unique_lock lg{mut_};
+        while (!jobs_.empty()) {
+            auto entry = std::move(jobs_.front());
+            jobs_.pop_front();
+            lg.unlock();
+            if (entry.queuedAt) {
+                tracer_.record("main_loop_queue_wait", entry.queuedAt,
+                               Tracer::now() - entry.queuedAt);
+            }
+            try {
+                entry.job();
+            } catch (const std::exception &e) {
+                FCITX_ERROR() << "WebServer main loop job: " << e.what();
+            }
+            lg.lock();
+            if (!jobs_.empty() && Clock::now() >= deadline) {
+                // Out of budget, keep signalled_ set and continue in the
+                // next main loop iteration.
+                lg.unlock();
+                dispatcher_.schedule([this]() { drain(); });
+                return;
+            }
+        }
+        signalled_ = false;
+    }
+
+    struct Entry {
+        Job job;
+        // When the job was queued, 0 if not traced.
+        uint64_t queuedAt;
+    };
+
+    EventDispatcher &dispatcher_;
+    const std::chrono::microseconds sliceBudget_;
+    Tracer &tracer_;
+    mutable std::mutex mut_;
+    std::deque<Entry> jobs_;
+    bool signalled_ = false;
+    bool shutdown_ = false;
+};
+
+} // namespace fcitx
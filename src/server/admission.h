@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace fcitx {
+
+/// Counts live connections and subscriptions against configurable limits.
+///
+/// Thread-safe, the limits are set on the main loop while slots are taken
+/// and released on the server thread.
+class AdmissionControl {
+public:
+    /// Holds one unit of a counter until destroyed, empty if the limit was
+    /// reached.
+    class Slot {
+    public:
+        Slot() = default;
+        explicit Slot(std::atomic<size_t> *counter) : counter_(counter) {}
+        Slot(Slot &&other) noexcept : counter_(other.counter_) {
+            other.counter_ = nullptr;
+        }
+        Slot &operator=(Slot &&other) noexcept {
+            if (this != &other) {
+                release();
+                counter_ = other.counter_;
+                other.counter_ = nullptr;
+            }
+            return *this;
+        }
+        Slot(const Slot &) = delete;
+        Slot &operator=(const Slot &) = delete;
+        ~Slot() { release(); }
+
+        explicit operator bool() const { return counter_ != nullptr; }
+
+        void release() {
+            if (counter_) {
+                counter_->fetch_sub(1, std::memory_order_relaxed);
+                counter_ = nullptr;
+            }
+        }
+
+    private:
+        std::atomic<size_t> *counter_ = nullptr;
+    };
+
+    void setLimits(size_t maxConnections, size_t maxSubscriptions) {
+        maxConnections_.store(maxConnections, std::memory_order_relaxed);
+        maxSubscriptions_.store(maxSubscriptions, std::memory_order_relaxed);
+    }
+
+    Slot tryAcquireConnection() {
+        return tryAcquire(connections_, maxConnections_);
+    }
+    Slot tryAcquireSubscription() {
+        return tryAcquire(subscriptions_, maxSubscriptions_);
+    }
+
+    size_t connections() const {
+        return connections_.load(std::memory_order_relaxed);
+    }
+    size_t subscriptions() const {
+        return subscriptions_.load(std::memory_order_relaxed);
+    }
+    size_t maxConnections() const {
+        return maxConnections_.load(std::memory_order_relaxed);
+    }
+    size_t maxSubscriptions() const {
+        return maxSubscriptions_.load(std::memory_order_relaxed);
+    }
+    /// Connections and subscriptions refused so far.
+    uint64_t rejected() const {
+        return rejected_.load(std::memory_order_relaxed);
+    }
+
+private:
+    Slot tryAcquire(std::atomic<size_t> &counter,
+                    const std::atomic<size_t> &limit) {
+        auto cur = counter.load(std::memory_order_relaxed);
+        do {
+            if (cur >= limit.load(std::memory_order_relaxed)) {
+                rejected_.fetch_add(1, std::memory_order_relaxed);
+                return {};
+            }
+        } while (!counter.compare_exchange_weak(cur, cur + 1,
+                                                std::memory_order_relaxed));
+        return Slot{&counter};
+    }
+
+    std::atomic<size_t> connections_{0};
+    std::atomic<size_t> subscriptions_{0};
+    std::atomic<size_t> maxConnections_{0};
+    std::atomic<size_t> maxSubscriptions_{0};
+    std::atomic<uint64_t> rejected_{0};
+};
+
+} // namespace fcitx
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace fcitx {
+
+/// Take the listening sockets passed by a service manager, following the
+/// LISTEN_FDS/LISTEN_PID protocol of sd_listen_fds(3).
+///
+/// The variables are unset so that they are not inherited by children of
+/// fcitx. Returns an empty list if no sockets were passed to this process.
+inline std::vector<int> takeInheritedListenFds() {
+    // The first passed fd, SD_LISTEN_FDS_START.
+    constexpr int ListenFdsStart = 3;
+    std::vector<int> fds;
+    const char *pid = std::getenv("LISTEN_PID");
+    const char *count = std::getenv("LISTEN_FDS");
+    if (pid && count && std::strtol(pid, nullptr, 10) == ::getpid()) {
+        auto n = std::strtol(count, nullptr, 10);
+        for (int fd = ListenFdsStart; n > 0 && fd < ListenFdsStart + n;
+             fd++) {
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fds.push_back(fd);
+        }
+    }
+    ::unsetenv("LISTEN_PID");
+    ::unsetenv("LISTEN_FDS");
+    ::unsetenv("LISTEN_FDNAMES");
+    return fds;
+}
+
+/// Address family of a socket, AF_UNSPEC if unknown.
+inline int socketFamily(int fd) {
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    if (::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+        return AF_UNSPEC;
+    }
+    return addr.ss_family;
+}
+
+namespace detail {
+
+inline int bindAndListen(int fd, const sockaddr *addr, socklen_t len) {
+    if (::bind(fd, addr, len) < 0 || ::listen(fd, SOMAXCONN) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+} // namespace detail
+
+/// Open a listening unix socket without an io_context, -1 on error.
+inline int listenUnixSocket(const std::string &path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    (void)::unlink(path.c_str());
+    return detail::bindAndListen(fd, reinterpret_cast<sockaddr *>(&addr),
+                                 sizeof(addr));
+}
+
+/// Open a listening tcp socket on 127.0.0.1 without an io_context, -1 on
+/// error.
+inline int listenLocalTcp(unsigned short port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    // Same as asio acceptors.
+    int one = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    return detail::bindAndListen(fd, reinterpret_cast<sockaddr *>(&addr),
+                                 sizeof(addr));
+}
+
+} // namespace fcitx
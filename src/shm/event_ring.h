@@ -0,0 +1,216 @@
+#pragma once
+
+// Reader of the shared memory event ring published by fcitx5-webserver.
+//
+// The ring is a file of fixed size slots written by a single producer, the
+// fcitx main loop. Every event is a json message as sent on /subscribe,
+// e.g. {"event":"input_context_commit_string","params":{...}}. Readers only
+// map the file and follow the sequence numbers: reading costs no syscalls
+// and no locks, and the producer never waits for them. A reader that falls
+// more than a ring behind loses the overwritten events and is told so.
+//
+// Self-contained, so that consumers can include it without fcitx.
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fcitx {
+namespace event_ring {
+
+using Word = std::atomic<uint64_t>;
+static_assert(Word::is_always_lock_free,
+              "the ring needs address-free 64-bit atomics");
+
+constexpr uint64_t Magic = 0x474e495256454246; // "FBEVRING"
+constexpr uint64_t Version = 1;
+
+// Marks a slot that is being written.
+constexpr uint64_t Busy = ~uint64_t(0);
+
+/// Start of the file, every field is a 64-bit word.
+struct Header {
+    Word magic;
+    Word version;
+    // Number of slots, a power of two.
+    Word slotCount;
+    // Bytes per slot, including its two words of seq and size.
+    Word slotSize;
+    // Sequence number of the next event to be written.
+    Word head;
+    // Set when the producer stopped or replaced the file, reopen then.
+    Word closed;
+    // Events not published for being larger than a slot.
+    Word oversized;
+};
+
+constexpr size_t HeaderSize = 64;
+static_assert(sizeof(Header) <= HeaderSize);
+
+constexpr size_t fileSize(uint64_t slotCount, uint64_t slotSize) {
+    return HeaderSize + slotCount * slotSize;
+}
+
+/// Words of slot i: [0] seq of the event in it, [1] payload size, [2...]
+/// payload.
+inline Word *slotAt(void *base, uint64_t slotSize, uint64_t i) {
+    return reinterpret_cast<Word *>(static_cast<char *>(base) + HeaderSize +
+                                    i * slotSize);
+}
+
+/// Where the ring is published unless configured otherwise, empty if
+/// XDG_RUNTIME_DIR is not set.
+inline std::string defaultPath() {
+    const char *dir = std::getenv("XDG_RUNTIME_DIR");
+    if (!dir || !*dir) {
+        return {};
+    }
+    return std::string(dir) + "/fcitx5-events";
+}
+
+} // namespace event_ring
+
+class EventRingReader {
+public:
+    enum class Status {
+        // An event was read.
+        Ok,
+        // Nothing new yet.
+        Empty,
+        // Events were overwritten before being read, the reader skipped to
+        // the oldest one still available.
+        Lost,
+        // The producer is gone, open the file again.
+        Closed,
+    };
+
+    /// Map the ring at path and start after the latest event. Throws
+    /// std::system_error or std::runtime_error.
+    explicit EventRingReader(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) < 0 ||
+            static_cast<size_t>(st.st_size) < event_ring::HeaderSize) {
+            ::close(fd);
+            throw std::runtime_error(path + ": not an event ring");
+        }
+        size_ = st.st_size;
+        base_ = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base_ == MAP_FAILED) {
+            base_ = nullptr;
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        header_ = static_cast<event_ring::Header *>(base_);
+        slotCount_ = header_->slotCount.load(std::memory_order_relaxed);
+        slotSize_ = header_->slotSize.load(std::memory_order_relaxed);
+        if (header_->magic.load(std::memory_order_acquire) !=
+                event_ring::Magic ||
+            header_->version.load(std::memory_order_relaxed) !=
+                event_ring::Version ||
+            slotCount_ == 0 || (slotCount_ & (slotCount_ - 1)) != 0 ||
+            slotSize_ < 3 * sizeof(uint64_t) || slotSize_ % 8 != 0 ||
+            event_ring::fileSize(slotCount_, slotSize_) > size_) {
+            ::munmap(base_, size_);
+            throw std::runtime_error(path + ": not an event ring");
+        }
+        seekToLatest();
+    }
+
+    ~EventRingReader() {
+        if (base_) {
+            ::munmap(base_, size_);
+        }
+    }
+
+    EventRingReader(const EventRingReader &) = delete;
+    EventRingReader &operator=(const EventRingReader &) = delete;
+
+    /// Skip everything written so far.
+    void seekToLatest() {
+        cursor_ = header_->head.load(std::memory_order_acquire);
+    }
+
+    /// Go back to the oldest event still in the ring.
+    void seekToOldest() {
+        auto head = header_->head.load(std::memory_order_acquire);
+        cursor_ = head > slotCount_ ? head - slotCount_ : 0;
+    }
+
+    /// Copy the next event into out. Never blocks, poll again on Empty.
+    Status next(std::string &out) {
+        auto head = header_->head.load(std::memory_order_acquire);
+        if (cursor_ >= head) {
+            if (header_->closed.load(std::memory_order_acquire)) {
+                return Status::Closed;
+            }
+            return Status::Empty;
+        }
+        if (head - cursor_ > slotCount_) {
+            lost_ += head - slotCount_ - cursor_;
+            cursor_ = head - slotCount_;
+            return Status::Lost;
+        }
+        if (!read(cursor_, out)) {
+            // The slot was completely written once, so it is being reused
+            // for a newer event: this one is gone. Never wait for the
+            // writer, which may have died in the middle.
+            lost_++;
+            cursor_++;
+            return Status::Lost;
+        }
+        cursor_++;
+        return Status::Ok;
+    }
+
+    /// Sequence number of the next event to read.
+    uint64_t cursor() const { return cursor_; }
+    /// Events lost so far for reading too slowly.
+    uint64_t lost() const { return lost_; }
+
+private:
+    // Seqlock read of the slot holding seq.
+    bool read(uint64_t seq, std::string &out) {
+        auto *slot =
+            event_ring::slotAt(base_, slotSize_, seq & (slotCount_ - 1));
+        if (slot[0].load(std::memory_order_acquire) != seq) {
+            return false;
+        }
+        auto size = slot[1].load(std::memory_order_relaxed);
+        if (size > slotSize_ - 2 * sizeof(uint64_t)) {
+            return false;
+        }
+        out.resize(size);
+        for (size_t i = 0; i * 8 < size; i++) {
+            auto word = slot[2 + i].load(std::memory_order_relaxed);
+            std::memcpy(out.data() + i * 8, &word,
+                        std::min<size_t>(8, size - i * 8));
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot[0].load(std::memory_order_relaxed) == seq;
+    }
+
+    void *base_ = nullptr;
+    size_t size_ = 0;
+    event_ring::Header *header_ = nullptr;
+    uint64_t slotCount_ = 0;
+    uint64_t slotSize_ = 0;
+    uint64_t cursor_ = 0;
+    uint64_t lost_ = 0;
+};
+
+} // namespace fcitx
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fcitx-utils/log.h>
+
+#include "event_ring.h"
+
+namespace fcitx {
+
+/// Producer side of the shared memory event ring, see event_ring.h.
+///
+/// Only one writer may exist per file, and write() must always be called
+/// from the same thread.
+class EventRingWriter {
+public:
+    ~EventRingWriter() {
+        header_->closed.store(1, std::memory_order_release);
+        ::munmap(base_, size_);
+        (void)::unlink(path_.c_str());
+    }
+
+    EventRingWriter(const EventRingWriter &) = delete;
+    EventRingWriter &operator=(const EventRingWriter &) = delete;
+
+    /// Create a fresh ring at path, nullptr on failure. slotSize is rounded
+    /// up to whole words and slotCount to a power of two.
+    static std::unique_ptr<EventRingWriter>
+    create(const std::string &path, uint64_t slotCount, uint64_t slotSize) {
+        slotSize = (slotSize + 7) / 8 * 8;
+        uint64_t count = 1;
+        while (count < slotCount) {
+            count *= 2;
+        }
+        auto size = event_ring::fileSize(count, slotSize);
+        // Readers still mapping an old file keep it, and see it closed.
+        (void)::unlink(path.c_str());
+        int fd = ::open(path.c_str(),
+                        O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                        0600);
+        if (fd < 0) {
+            FCITX_ERROR() << "WebServer event ring: cannot create " << path
+                          << ": " << std::strerror(errno);
+            return nullptr;
+        }
+        void *base = MAP_FAILED;
+        if (::ftruncate(fd, size) == 0) {
+            base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0);
+        }
+        int err = errno;
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            FCITX_ERROR() << "WebServer event ring: cannot map " << path
+                          << ": " << std::strerror(err);
+            (void)::unlink(path.c_str());
+            return nullptr;
+        }
+        return std::unique_ptr<EventRingWriter>(
+            new EventRingWriter(path, base, size, count, slotSize));
+    }
+
+    /// Publish one event, dropped if it does not fit in a slot.
+    void write(std::string_view data) {
+        if (data.size() > slotSize_ - 2 * sizeof(uint64_t)) {
+            header_->oversized.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto seq = head_++;
+        auto *slot =
+            event_ring::slotAt(base_, slotSize_, seq & (slotCount_ - 1));
+        slot[0].store(event_ring::Busy, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot[1].store(data.size(), std::memory_order_relaxed);
+        for (size_t i = 0; i * 8 < data.size(); i++) {
+            uint64_t word = 0;
+            std::memcpy(&word, data.data() + i * 8,
+                        std::min<size_t>(8, data.size() - i * 8));
+            slot[2 + i].store(word, std::memory_order_relaxed);
+        }
+        slot[0].store(seq, std::memory_order_release);
+        header_->head.store(head_, std::memory_order_release);
+    }
+
+private:
+    EventRingWriter(std::string path, void *base, size_t size,
+                    uint64_t slotCount, uint64_t slotSize)
+        : base_(base), size_(size), path_(std::move(path)),
+          header_(static_cast<event_ring::Header *>(base)),
+          slotCount_(slotCount), slotSize_(slotSize) {
+        // A zero filled slot would pass for the event with seq 0.
+        for (uint64_t i = 0; i < slotCount_; i++) {
+            event_ring::slotAt(base_, slotSize_, i)[0].store(
+                event_ring::Busy, std::memory_order_relaxed);
+        }
+        header_->slotCount.store(slotCount_, std::memory_order_relaxed);
+        header_->slotSize.store(slotSize_, std::memory_order_relaxed);
+        header_->version.store(event_ring::Version,
+                               std::memory_order_relaxed);
+        header_->magic.store(event_ring::Magic, std::memory_order_release);
+    }
+
+    void *base_;
+    size_t size_;
+    std::string path_;
+    event_ring::Header *header_;
+    const uint64_t slotCount_;
+    const uint64_t slotSize_;
+    uint64_t head_ = 0;
+};
+
+} // namespace fcitx
@@ -5,12 +5,41 @@
 
 #include "fcitx/event.h"
 
-inline const std::unordered_map<std::string, fcitx::EventType> &ev_map() {
-    static const std::unordered_map<std::string, fcitx::EventType> ev_map{
-        {"input_context_focus_in", fcitx::EventType::InputContextFocusIn},
-        {"input_context_focus_out", fcitx::EventType::InputContextFocusOut},
+enum class ev_delivery {
+    // Always delivered as soon as possible.
+    immediate,
+    // Fires per keystroke, subject to sampling and the subscriber's max
+    // rate. Events over the rate are dropped.
+    throttled,
+    // Like throttled, but events over the rate are coalesced, only the
+    // latest one for an input context is delivered.
+    coalesced,
+};
+
+struct ev_info {
+    fcitx::EventType type;
+    ev_delivery delivery;
+};
+
+inline const std::unordered_map<std::string, ev_info> &ev_map() {
+    static const std::unordered_map<std::string, ev_info> ev_map{
+        {"input_context_focus_in",
+         {fcitx::EventType::InputContextFocusIn, ev_delivery::immediate}},
+        {"input_context_focus_out",
+         {fcitx::EventType::InputContextFocusOut, ev_delivery::immediate}},
         {"input_context_switch_input_method",
-         fcitx::EventType::InputContextSwitchInputMethod},
+         {fcitx::EventType::InputContextSwitchInputMethod,
+          ev_delivery::immediate}},
+        {"input_context_key_event",
+         {fcitx::EventType::InputContextKeyEvent, ev_delivery::throttled}},
+        {"input_context_commit_string",
+         {fcitx::EventType::InputContextCommitString,
+          ev_delivery::throttled}},
+        {"input_context_update_preedit",
+         {fcitx::EventType::InputContextUpdatePreedit,
+          ev_delivery::coalesced}},
+        {"input_context_update_candidates",
+         {fcitx::EventType::InputContextUpdateUI, ev_delivery::coalesced}},
     };
 
     return ev_map;
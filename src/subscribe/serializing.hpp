@@ -1,54 +1,153 @@
 #pragma once
 
-#include <sstream>
 #include <string>
-#include <unordered_map>
 
 #include "nlohmann/json.hpp"
 
 #include "fcitx-utils/log.h"
+#include "fcitx/candidatelist.h"
 #include "fcitx/event.h"
+#include "fcitx/inputcontext.h"
+#include "fcitx/inputpanel.h"
 
-std::unordered_map<std::string, std::string>
-extract_params(fcitx::Instance *instance, fcitx::EventType typ,
-               fcitx::Event &event) {
-    std::unordered_map<std::string, std::string> params;
+#include "../controller/state_snapshot.h"
 
-    // TODO this should be put after InputContextEvent judge
+/// Whether the input context asks to keep what is typed in it private, e.g.
+/// a password field.
+inline bool is_private(fcitx::InputContext *ic) {
+    auto flags = ic->capabilityFlags();
+    return flags.test(fcitx::CapabilityFlag::Password) ||
+           flags.test(fcitx::CapabilityFlag::Sensitive);
+}
+
+/// Whether the event carries what the user types.
+inline bool reveals_input(fcitx::EventType typ) {
+    switch (typ) {
+    case fcitx::EventType::InputContextKeyEvent:
+    case fcitx::EventType::InputContextCommitString:
+    case fcitx::EventType::InputContextUpdatePreedit:
+    case fcitx::EventType::InputContextUpdateUI:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// Whether the event is delivered at all, cheap enough to check before
+/// rate limiting.
+inline bool is_delivered(fcitx::EventType typ, fcitx::Event &event) {
+    // All the events in ev_map() are input context events.
+    auto *ic = static_cast<fcitx::InputContextEvent &>(event).inputContext();
+    if (reveals_input(typ) && is_private(ic)) {
+        return false;
+    }
+    if (typ == fcitx::EventType::InputContextUpdateUI) {
+        auto &uiEvent = static_cast<fcitx::InputContextUpdateUIEvent &>(event);
+        return uiEvent.component() ==
+               fcitx::UserInterfaceComponent::InputPanel;
+    }
+    return true;
+}
+
+inline void add_ic_params(nlohmann::json &params, fcitx::InputContext *ic) {
+    params["uuid"] = ic_uuid_str(ic);
+    params["program"] = ic->program();
+    params["frontend"] = ic->frontendName();
+}
+
+/// Extract the current state of an input context, for the events that
+/// report a state rather than something that happened, i.e. the coalesced
+/// ones. Must be called on the main loop.
+///
+/// Returns null if the input context became private since the update.
+inline nlohmann::json extract_ic_state(fcitx::EventType typ,
+                                       fcitx::InputContext *ic) {
+    if (is_private(ic)) {
+        return nullptr;
+    }
+    nlohmann::json params = nlohmann::json::object();
+
+    switch (typ) {
+    case fcitx::EventType::InputContextUpdatePreedit: {
+        const auto &panel = ic->inputPanel();
+        params["preedit"] = panel.preedit().toString();
+        params["preedit_cursor"] = panel.preedit().cursor();
+        params["client_preedit"] = panel.clientPreedit().toString();
+        params["client_preedit_cursor"] = panel.clientPreedit().cursor();
+        break;
+    }
+    case fcitx::EventType::InputContextUpdateUI: {
+        auto candidates = nlohmann::json::array();
+        int cursor = -1;
+        if (auto list = ic->inputPanel().candidateList()) {
+            for (int i = 0; i < list->size(); i++) {
+                candidates.push_back(list->candidate(i).text().toString());
+            }
+            cursor = list->cursorIndex();
+        }
+        params["candidates"] = std::move(candidates);
+        params["cursor_index"] = cursor;
+        break;
+    }
+    default:
+        FCITX_WARN() << "cannot extract state";
+        return nullptr;
+    }
+
+    add_ic_params(params, ic);
+    return params;
+}
+
+/// Extract the parameters of an event, must be called on the main loop.
+///
+/// Returns null if the event should not be delivered.
+inline nlohmann::json extract_params(fcitx::Instance *instance,
+                                     fcitx::EventType typ,
+                                     fcitx::Event &event) {
+    // All the events in ev_map() are input context events.
     auto &icEvent = static_cast<fcitx::InputContextEvent &>(event);
     auto *ic = icEvent.inputContext();
-    std::ostringstream ss;
-    ss << std::hex << std::setfill('0') << std::setw(2);
-    for (auto v : ic->uuid()) {
-        ss << static_cast<int>(v);
+    if (!is_delivered(typ, event)) {
+        return nullptr;
     }
+    nlohmann::json params = nlohmann::json::object();
+
     switch (typ) {
     case fcitx::EventType::InputContextSwitchInputMethod:
         params["input_method"] = instance->inputMethod(ic);
-        // fallthrough
+        break;
     case fcitx::EventType::InputContextFocusIn:
-        // fallthrough
     case fcitx::EventType::InputContextFocusOut:
-        params["uuid"] = ss.str();
-        params["program"] = ic->program();
-        params["frontend"] = ic->frontendName();
         break;
+    case fcitx::EventType::InputContextKeyEvent: {
+        auto &keyEvent = static_cast<fcitx::KeyEvent &>(event);
+        params["key"] = keyEvent.key().toString();
+        params["is_release"] = keyEvent.isRelease();
+        params["accepted"] = keyEvent.accepted();
+        break;
+    }
+    case fcitx::EventType::InputContextCommitString: {
+        auto &commitEvent = static_cast<fcitx::CommitStringEvent &>(event);
+        params["text"] = commitEvent.text();
+        break;
+    }
+    case fcitx::EventType::InputContextUpdatePreedit:
+    case fcitx::EventType::InputContextUpdateUI:
+        return extract_ic_state(typ, ic);
     default:
         FCITX_WARN() << "cannot extract params";
+        return nullptr;
     }
 
+    add_ic_params(params, ic);
     return params;
 }
 
-std::string
-to_json_str(const std::string &ev,
-            const std::unordered_map<std::string, std::string> &params) {
+inline std::string to_json_str(const std::string &ev,
+                               const nlohmann::json &params) {
     nlohmann::json j{
         {"event", ev},
-        {"params", nlohmann::json::object()},
+        {"params", params},
     };
-    for (const auto &[k, v] : params) {
-        j["params"][k] = v;
-    }
     return j.dump();
 }
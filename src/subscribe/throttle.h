@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/// Per-subscriber delivery options for high frequency events, parsed from
+/// the query string of the subscribe request, e.g.
+/// /subscribe/input_context_key_event?max_rate=30&sample=2
+struct throttle_options {
+    // Lowest accepted max_rate, lower ones are raised to it.
+    static constexpr double min_rate = 0.1;
+
+    // Messages per second, 0 for unlimited.
+    double max_rate = 60;
+    // Deliver one out of every `sample` events of each kind.
+    unsigned sample = 1;
+    // Coalesce state updates (preedit, candidates) instead of dropping them.
+    bool coalesce = true;
+
+    static throttle_options parse(std::string_view query) {
+        throttle_options opts;
+        while (!query.empty()) {
+            auto amp = query.find('&');
+            auto part = query.substr(0, amp);
+            query = amp == std::string_view::npos ? std::string_view{}
+                                                  : query.substr(amp + 1);
+            auto eq = part.find('=');
+            if (eq == std::string_view::npos) {
+                continue;
+            }
+            auto key = part.substr(0, eq);
+            std::string value{part.substr(eq + 1)};
+            try {
+                if (key == "max_rate") {
+                    auto rate = std::stod(value);
+                    opts.max_rate = !std::isfinite(rate) || rate <= 0
+                                        ? 0
+                                        : std::max(min_rate, rate);
+                } else if (key == "sample") {
+                    opts.sample =
+                        std::max(1UL, std::stoul(value));
+                } else if (key == "coalesce") {
+                    opts.coalesce = value != "0" && value != "false";
+                }
+            } catch (const std::exception &) {
+                // Ignore malformed values, keep the default.
+            }
+        }
+        return opts;
+    }
+};
+
+/// Token bucket limiting the rate of high frequency messages of one
+/// subscriber. Not thread-safe.
+class event_throttle {
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit event_throttle(const throttle_options &opts)
+        : opts_(opts), burst_(std::max(1.0, opts.max_rate / 4)),
+          tokens_(burst_), last_(clock::now()) {}
+
+    const throttle_options &options() const { return opts_; }
+
+    /// Whether this occurrence of ev survives sampling.
+    bool sample(const std::string &ev) {
+        if (opts_.sample <= 1) {
+            return true;
+        }
+        return counters_[ev]++ % opts_.sample == 0;
+    }
+
+    /// Take one token if available.
+    bool acquire(clock::time_point now = clock::now()) {
+        if (opts_.max_rate <= 0) {
+            return true;
+        }
+        refill(now);
+        if (tokens_ < 1) {
+            return false;
+        }
+        tokens_ -= 1;
+        return true;
+    }
+
+    /// How long until the next token is available.
+    clock::duration wait_time(clock::time_point now = clock::now()) {
+        if (opts_.max_rate <= 0) {
+            return clock::duration::zero();
+        }
+        refill(now);
+        if (tokens_ >= 1) {
+            return clock::duration::zero();
+        }
+        // Bounded, so that the cast never overflows.
+        auto seconds = std::min((1 - tokens_) / opts_.max_rate,
+                                1 / throttle_options::min_rate);
+        return std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(seconds));
+    }
+
+private:
+    void refill(clock::time_point now) {
+        std::chrono::duration<double> elapsed = now - last_;
+        last_ = now;
+        tokens_ = std::min(burst_, tokens_ + elapsed.count() * opts_.max_rate);
+    }
+
+    throttle_options opts_;
+    double burst_;
+    double tokens_;
+    clock::time_point last_;
+    std::unordered_map<std::string, unsigned> counters_;
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <unistd.h>
+
+#include "nlohmann/json.hpp"
+
+namespace fcitx {
+
+/// Records timing spans into a fixed size in-memory ring, dumped in Chrome
+/// trace format for chrome://tracing or Perfetto.
+///
+/// Recording is lock-free and may happen on any thread. When disabled, a
+/// span costs one atomic load.
+class Tracer {
+public:
+    static constexpr size_t Capacity = 1 << 15;
+
+    /// Microseconds on a monotonic clock.
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    /// Small id of the calling thread, stable for its lifetime.
+    static uint64_t threadId() {
+        static std::atomic<uint64_t> next{1};
+        thread_local const uint64_t id = next.fetch_add(1);
+        return id;
+    }
+
+    /// Must be called on the main loop.
+    void setEnabled(bool enabled) {
+        if (enabled && !slots_) {
+            slots_ = std::make_unique<Slot[]>(Capacity);
+            ring_.store(slots_.get(), std::memory_order_release);
+        }
+        enabled_.store(enabled, std::memory_order_release);
+    }
+
+    bool enabled() const { return enabled_.load(std::memory_order_acquire); }
+
+    /// name must be a string literal.
+    void record(const char *name, uint64_t start, uint64_t duration) {
+        if (!enabled()) {
+            return;
+        }
+        auto *ring = ring_.load(std::memory_order_acquire);
+        auto idx = head_.fetch_add(1, std::memory_order_relaxed);
+        auto &slot = ring[idx % Capacity];
+        // Odd while being written, readers skip the slot.
+        slot.seq.store(2 * idx + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.start.store(start, std::memory_order_relaxed);
+        slot.duration.store(duration, std::memory_order_relaxed);
+        slot.tid.store(threadId(), std::memory_order_relaxed);
+        slot.seq.store(2 * idx + 2, std::memory_order_release);
+    }
+
+    /// The recorded spans as a Chrome trace json document.
+    std::string dumpChromeTrace() const {
+        auto events = nlohmann::json::array();
+        // Spans recorded before tracing was disabled are still dumped.
+        if (const auto *ring = ring_.load(std::memory_order_acquire)) {
+            const auto pid = ::getpid();
+            for (size_t i = 0; i < Capacity; i++) {
+                const auto &slot = ring[i];
+                auto seq = slot.seq.load(std::memory_order_acquire);
+                if (seq == 0 || seq % 2) {
+                    continue;
+                }
+                const char *name = slot.name.load(std::memory_order_relaxed);
+                auto start = slot.start.load(std::memory_order_relaxed);
+                auto duration = slot.duration.load(std::memory_order_relaxed);
+                auto tid = slot.tid.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.seq.load(std::memory_order_relaxed) != seq) {
+                    // Overwritten while reading.
+                    continue;
+                }
+                events.push_back({{"name", name},
+                                  {"cat", "webserver"},
+                                  {"ph", "X"},
+                                  {"ts", start},
+                                  {"dur", duration},
+                                  {"pid", pid},
+                                  {"tid", tid}});
+            }
+        }
+        return nlohmann::json{{"traceEvents", std::move(events)},
+                              {"displayTimeUnit", "ms"}}
+            .dump();
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        std::atomic<const char *> name{nullptr};
+        std::atomic<uint64_t> start{0};
+        std::atomic<uint64_t> duration{0};
+        std::atomic<uint64_t> tid{0};
+    };
+
+    std::atomic<bool> enabled_{false};
+    std::atomic<uint64_t> head_{0};
+    // Allocated on first enable and kept, so that concurrent writers never
+    // see it go away.
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<Slot *> ring_{nullptr};
+};
+
+/// Records the lifetime of a scope as a span.
+class TraceSpan {
+public:
+    TraceSpan(Tracer &tracer, const char *name)
+        : tracer_(tracer.enabled() ? &tracer : nullptr), name_(name),
+          start_(tracer_ ? Tracer::now() : 0) {}
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+    ~TraceSpan() {
+        if (tracer_) {
+            tracer_->record(name_, start_, Tracer::now() - start_);
+        }
+    }
+
+private:
+    Tracer *tracer_;
+    const char *name_;
+    uint64_t start_;
+};
+
+} // namespace fcitx
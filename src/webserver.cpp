@@ -7,23 +7,29 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
 
+#include <algorithm>
 #include <condition_variable>
+#include <fcntl.h>
 #include <fcitx-config/iniparser.h>
 #include <fcitx/event.h>
 #include <fcitx/inputcontextmanager.h>
 #include <queue>
+#include <set>
 #include <unistd.h>
 
 #include "config/config-public.h"
 #include "controller/router.h"
 #include "subscribe/ev_map.h"
 #include "subscribe/serializing.hpp"
+#include "subscribe/throttle.h"
 
 #include "nlohmann/json.hpp"
 
 #ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
 // For unlink(2)
 #include <unistd.h>
+
+#include "server/listen_fds.h"
 #endif
 
 namespace beast = boost::beast;
@@ -36,36 +42,54 @@ namespace fcitx {
 
 WebServer::WebServer(Instance *instance) : instance_(instance) {
     dispatcher_.attach(&instance->eventLoop());
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+    inheritedFds_ = takeInheritedListenFds();
+    if (!inheritedFds_.empty()) {
+        FCITX_INFO() << "WebServer: using " << inheritedFds_.size()
+                     << " inherited listening sockets";
+    }
+#endif
+    watchState();
     reloadConfig();
 }
 
-WebServer::~WebServer() { stopThread(); }
+WebServer::~WebServer() {
+    stopThread();
+    // Sessions destroyed with a threadless io_context may still post.
+    jobQueue_.shutdown();
+    lazyWatchers_.clear();
+    for (int fd : adoptFds_) {
+        ::close(fd);
+    }
+    for (int fd : inheritedFds_) {
+        ::close(fd);
+    }
+}
 
 std::string WebServer::routedGetConfig(const std::string &uri) {
-    std::promise<std::string> prom;
-    auto fut = prom.get_future();
-    dispatcher_.schedule([this, &uri, &prom]() {
-        try {
-            prom.set_value(getInstanceConfig(uri, this->instance_));
-        } catch (...) {
-            prom.set_exception(std::current_exception());
-        }
+    // Only copy the config on the main loop, the json document is built on
+    // the calling thread.
+    auto captured = runOnMainLoop([this, &uri]() {
+        TraceSpan span{tracer_, "get_config_capture"};
+        auto start = std::chrono::steady_clock::now();
+        auto captured = captureInstanceConfig(uri, this->instance_);
+        FCITX_DEBUG() << "getConfig " << uri << " took "
+                      << std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start)
+                             .count()
+                      << "us on the main loop";
+        return captured;
     });
-    return fut.get();
+    TraceSpan span{tracer_, "config_to_json"};
+    return capturedConfigToJson(captured);
 }
 
-std::string WebServer::routedSetConfig(const std::string &uri, const char *data,
-                                       size_t sz) {
-    std::promise<bool> prom;
-    auto fut = prom.get_future();
-    dispatcher_.schedule([this, &uri, &prom, data, sz]() {
-        try {
-            prom.set_value(setInstanceConfig(uri, data, sz, this->instance_));
-        } catch (...) {
-            prom.set_exception(std::current_exception());
-        }
-    });
-    if (!fut.get()) {
+std::string WebServer::routedSetConfig(const std::string &uri,
+                                       const RawConfig &config) {
+    if (!runOnMainLoop([this, &uri, &config]() {
+            TraceSpan span{tracer_, "set_config"};
+            return setInstanceConfig(uri, config, this->instance_);
+        })) {
         return nlohmann::json{{"ERROR", "Failed to set config"}}.dump();
     } else {
         return nlohmann::json{{}}.dump();
@@ -73,17 +97,51 @@ std::string WebServer::routedSetConfig(const std::string &uri, const char *data,
 }
 
 std::string WebServer::routedControllerRequest(const std::string &path) {
-    std::promise<std::string> prom;
-    auto fut = prom.get_future();
-    dispatcher_.schedule([this, &path, &prom]() {
-        try {
-            prom.set_value(
-                handle_controller_request(path, this->instance_).dump());
-        } catch (...) {
-            prom.set_exception(std::current_exception());
+    // Read-only methods are answered on the calling thread.
+    if (auto snapshot = state()) {
+        TraceSpan span{tracer_, "handle_snapshot_request"};
+        if (auto result = handle_snapshot_request(path, *snapshot)) {
+            return result->dump();
         }
+    }
+    return runOnMainLoop([this, &path]() {
+        TraceSpan span{tracer_, "handle_controller_request"};
+        return handle_controller_request(path, this->instance_).dump();
     });
-    return fut.get();
+}
+
+InputContext *WebServer::focusedInputContext() {
+    auto *ic = instance_->inputContextManager().lastFocusedInputContext();
+    return ic && ic->hasFocus() ? ic : nullptr;
+}
+
+void WebServer::publishState(InputContext *focused) {
+    state_.store(capture_state(instance_, focused));
+}
+
+void WebServer::watchState() {
+    stateWatchers_.emplace_back(instance_->watchEvent(
+        EventType::InputContextFocusIn, EventWatcherPhase::PostInputMethod,
+        [this](Event &event) {
+            auto &icEvent = static_cast<InputContextEvent &>(event);
+            publishState(icEvent.inputContext());
+        }));
+    stateWatchers_.emplace_back(instance_->watchEvent(
+        EventType::InputContextFocusOut, EventWatcherPhase::PostInputMethod,
+        [this](Event &event) {
+            auto &icEvent = static_cast<InputContextEvent &>(event);
+            auto *focused = focusedInputContext();
+            publishState(focused == icEvent.inputContext() ? nullptr
+                                                           : focused);
+        }));
+    stateWatchers_.emplace_back(instance_->watchEvent(
+        EventType::InputContextSwitchInputMethod,
+        EventWatcherPhase::PostInputMethod,
+        [this](Event &) { publishState(focusedInputContext()); }));
+    stateWatchers_.emplace_back(instance_->watchEvent(
+        EventType::InputMethodGroupChanged, EventWatcherPhase::Default,
+        [this](Event &) { publishState(focusedInputContext()); }));
+    publishState(focusedInputContext());
 }
 
 void WebServer::setConfig(const RawConfig &config) {
@@ -94,54 +152,266 @@ void WebServer::setConfig(const RawConfig &config) {
 
 void WebServer::reloadConfig() {
     dispatcher_.schedule([this]() {
-        if (this->serverThread_.joinable()) {
+        readAsIni(config_, ConfPath);
+        tracer_.setEnabled(config_.tracing.value());
+        const auto &limits = config_.limits.value();
+        admission_.setLimits(limits.maxConnections.value(),
+                             limits.maxSubscriptions.value());
+        maxBodySize_ = limits.maxBodySize.value();
+        const auto &timeouts = config_.timeouts.value();
+        readTimeout_ = timeouts.read.value();
+        handshakeTimeout_ = timeouts.handshake.value();
+        webSocketIdleTimeout_ = timeouts.webSocketIdle.value();
+        this->updateEventRing();
+        bool threadless =
+            config_.threading.value() == WebServerThreading::MainLoop;
+        if (this->serverRunning() && threadless != threadless_) {
+            // Sessions cannot move between the modes, start over.
             this->stopThread();
         }
-        readAsIni(config_, ConfPath);
-        this->startThread();
+        threadless_ = threadless;
+        if (this->serverRunning()) {
+            // Only rebinds if the listening address changed, established
+            // connections stay on the running io_context.
+            this->updateListener();
+        } else if (config_.lazyStart.value()) {
+            this->prepareLazyStart();
+        } else {
+            this->startServer();
+        }
     });
 }
 
+// Runs on the main loop, recreates the ring only if its settings changed.
+void WebServer::updateEventRing() {
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+    const auto &ring = config_.eventRing.value();
+    auto path = ring.path.value();
+    if (path.empty()) {
+        path = event_ring::defaultPath();
+    }
+    std::string key;
+    if (ring.enabled.value()) {
+        if (path.empty()) {
+            FCITX_ERROR() << "WebServer event ring: XDG_RUNTIME_DIR is not "
+                             "set, configure a path";
+        } else {
+            key = path + ":" + std::to_string(ring.slots.value()) + ":" +
+                  std::to_string(ring.slotSize.value());
+        }
+    }
+    if (key == eventRingKey_) {
+        return;
+    }
+    eventRingWatchers_.clear();
+    eventRing_.reset();
+    eventRingKey_.clear();
+    if (key.empty()) {
+        return;
+    }
+    eventRing_ = EventRingWriter::create(path, ring.slots.value(),
+                                         ring.slotSize.value());
+    if (!eventRing_) {
+        // Retry on next reload.
+        return;
+    }
+    eventRingKey_ = key;
+    // Unlike /subscribe, nothing is throttled: readers that fall behind only
+    // lose events on their own side.
+    for (const auto &entry : ev_map()) {
+        auto evname = entry.first;
+        auto ev = entry.second.type;
+        eventRingWatchers_.emplace_back(instance_->watchEvent(
+            ev, EventWatcherPhase::PostInputMethod,
+            [this, ev, evname](Event &event) {
+                TraceSpan span{tracer_, "event_ring_write"};
+                auto params = extract_params(instance_, ev, event);
+                if (params.is_null()) {
+                    return;
+                }
+                eventRing_->write(to_json_str(evname, params));
+            }));
+    }
+#endif
+}
+
+void WebServer::startServer() {
+    // Never called from a lazy watcher's own callback. The listener takes
+    // over the sockets they watch.
+    lazyWatchers_.clear();
+    startThread();
+    updateListener();
+}
+
+// Listen without creating the server thread and io_context, and only create
+// them once the first connection arrives.
+void WebServer::prepareLazyStart() {
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+    if (inheritedFds_.empty()) {
+        auto key = configuredListenKey();
+        if (key != adoptKey_) {
+            lazyWatchers_.clear();
+            for (int fd : adoptFds_) {
+                ::close(fd);
+            }
+            adoptFds_.clear();
+            adoptKey_.clear();
+            int fd = -1;
+            if (stringutils::startsWith(key, "unix:")) {
+                fd = listenUnixSocket(config_.unix_socket.value().path.value());
+            } else {
+                fd = listenLocalTcp(config_.tcp.value().port.value());
+            }
+            if (fd < 0) {
+                FCITX_ERROR() << "WebServer failed to listen on " << key;
+                return;
+            }
+            adoptFds_.push_back(fd);
+            adoptKey_ = key;
+        }
+    }
+    if (!lazyWatchers_.empty()) {
+        return;
+    }
+    const auto &fds = inheritedFds_.empty() ? adoptFds_ : inheritedFds_;
+    for (int fd : fds) {
+        lazyWatchers_.push_back(instance_->eventLoop().addIOEvent(
+            fd, IOEventFlag::In, [this](EventSourceIO *, int, IOEventFlags) {
+                // The connection stays in the backlog until the new
+                // listener accepts it.
+                for (auto &watcher : lazyWatchers_) {
+                    watcher->setEnabled(false);
+                }
+                // Out of the callback, and before the io_context watches
+                // the same sockets in threadless mode.
+                dispatcher_.schedule([this]() {
+                    if (serverRunning()) {
+                        // Already started by a reload.
+                        lazyWatchers_.clear();
+                        return;
+                    }
+                    startServer();
+                });
+                return true;
+            }));
+    }
+#else
+    startServer();
+#endif
+}
+
 template <class Stream>
 class ws_subscription
     : public std::enable_shared_from_this<ws_subscription<Stream>> {
 public:
-    ws_subscription(Stream stream, WebServer *addon)
-        : stream_(std::move(stream)), addon_(addon) {}
+    ws_subscription(Stream stream, WebServer *addon,
+                    const throttle_options &opts,
+                    AdmissionControl::Slot connectionSlot,
+                    AdmissionControl::Slot subscriptionSlot)
+        : stream_(std::move(stream)), addon_(addon), throttle_(opts),
+          pumpWatch_(addon->watchIo(
+              beast::get_lowest_layer(stream_).native_handle())),
+          flushTimer_(stream_.get_executor()),
+          connectionSlot_(std::move(connectionSlot)),
+          subscriptionSlot_(std::move(subscriptionSlot)) {}
 
+    // Events are only watched once the subscription starts.
     void watch(const std::string &evname) {
         FCITX_INFO() << "subscribe: watching " << evname;
-        auto ev = convert_ev_name(evname);
-        if (static_cast<int>(ev) == 0) {
+        if (ev_map().find(evname) == ev_map().end()) {
             FCITX_WARN() << "unknown event to subscribe: " << evname;
             return;
         }
-        eventWatchers_.emplace_back(addon_->instance()->watchEvent(
-            ev, EventWatcherPhase::PostInputMethod,
-            [this, ev, evname](Event &event) {
-                this->post(evname,
-                           extract_params(this->addon_->instance(), ev, event));
-            }));
+        evnames_.push_back(evname);
     }
 
+    // Watches all the events that are not sent per keystroke.
     void watch_all() {
         for (const auto &[k, v] : ev_map()) {
-            watch(k);
+            if (v.delivery == ev_delivery::immediate) {
+                watch(k);
+            }
         }
     }
 
-    void start() { do_accept(); }
+    void start() {
+        register_watchers();
+        do_accept();
+    }
 
     template <class Request>
     void start(const Request &upgrade) {
+        register_watchers();
         do_accept(upgrade);
     }
 
 private:
+    // Event watchers may only be touched on the main loop.
+    void register_watchers() {
+        addon_->postToMainLoop([self = this->shared_from_this()]() {
+            if (self->ended_) {
+                return;
+            }
+            for (const auto &evname : self->evnames_) {
+                self->watch_event(evname);
+            }
+        });
+    }
+
+    void watch_event(const std::string &evname) {
+        auto [ev, delivery] = ev_map().at(evname);
+        eventWatchers_.emplace_back(addon_->instance()->watchEvent(
+            ev, EventWatcherPhase::PostInputMethod,
+            [this, ev, delivery, evname](Event &event) {
+                auto *ic =
+                    static_cast<InputContextEvent &>(event).inputContext();
+                if (!is_delivered(ev, event) ||
+                    !this->admit(evname, delivery, ic)) {
+                    return;
+                }
+                nlohmann::json params;
+                {
+                    TraceSpan span{this->addon_->tracer(), "extract_params"};
+                    params =
+                        extract_params(this->addon_->instance(), ev, event);
+                }
+                if (params.is_null()) {
+                    return;
+                }
+                this->post(evname, std::move(params));
+            }));
+    }
+
+    // Unregister the event watchers as soon as the peer is gone, so that
+    // the main loop does no more work for it.
+    void end_session() {
+        if (ended_.exchange(true)) {
+            return;
+        }
+        addon_->postToMainLoop([self = this->shared_from_this()]() {
+            self->eventWatchers_.clear();
+        });
+    }
+
+    void set_timeouts() {
+        // Beast's own timer decides when to ping or give up, poll for it.
+        pumpWatch_.setHeartbeat(addon_->handshakeTimeout());
+        websocket::stream_base::timeout opt;
+        opt.handshake_timeout = addon_->handshakeTimeout();
+        // Beast pings the peer after half the idle timeout without traffic,
+        // and closes the stream if nothing arrives in the other half.
+        opt.idle_timeout = addon_->webSocketIdleTimeout();
+        opt.keep_alive_pings = true;
+        stream_.set_option(opt);
+    }
+
     template <class Request>
     void do_accept(const Request &upgrade) {
+        set_timeouts();
         auto uptr = std::make_shared<const Request>(upgrade);
-        stream_.async_accept(*uptr, [this, uptr, sg = this->shared_from_this()](
+        // The request is already read, only the response is written.
+        stream_.async_accept(*uptr, [this, uptr, sg = this->shared_from_this(),
+                                     io = pumpWatch_.track(IOEventFlag::Out)](
                                         boost::system::error_code ec) {
             (void)sg;
             (void)uptr;
@@ -150,7 +420,9 @@ private:
     }
 
     void do_accept() {
-        stream_.async_accept([this, sg = this->shared_from_this()](
+        set_timeouts();
+        stream_.async_accept([this, sg = this->shared_from_this(),
+                              io = pumpWatch_.track(IOEventFlag::In)](
                                  boost::system::error_code ec) {
             (void)sg;
             this->accept_done(ec);
@@ -159,46 +431,148 @@ private:
 
     void accept_done(boost::system::error_code ec) {
         if (ec) {
-            FCITX_ERROR() << "ws send: " << ec.message();
+            FCITX_ERROR() << "ws accept: " << ec.message();
+            end_session();
             return;
         }
+        pumpWatch_.setHeartbeat(addon_->webSocketIdleTimeout() / 2);
         do_recv();
     }
 
-    static fcitx::EventType convert_ev_name(const std::string &name) {
-        auto it = ev_map().find(name);
-        if (it == ev_map().end())
-            return static_cast<fcitx::EventType>(0);
-        return it->second;
+    struct message {
+        std::string event;
+        nlohmann::json params;
+    };
+
+    // Runs on the main loop before extracting params, so that sampled out
+    // and rate limited events cost as little as possible. A coalesced event
+    // over the rate only marks its input context dirty, the latest state is
+    // extracted once the flush timer sends it.
+    bool admit(const std::string &ev, ev_delivery delivery,
+               InputContext *ic) {
+        if (ended_) {
+            return false;
+        }
+        if (delivery == ev_delivery::immediate) {
+            return true;
+        }
+        std::unique_lock lg{mut_};
+        bool sampled = throttle_.sample(ev);
+        if (delivery == ev_delivery::throttled) {
+            return sampled && throttle_.acquire();
+        }
+        dirty_key key{ev, ic->uuid()};
+        // A sampled out update may be the last one, coalesce it too so that
+        // the latest state is always sent.
+        if (sampled && throttle_.acquire()) {
+            // Anything pending for this input context is stale now.
+            dirty_.erase(key);
+            return true;
+        }
+        if (!throttle_.options().coalesce) {
+            return false;
+        }
+        dirty_.insert(std::move(key));
+        if (!flushing_) {
+            flushing_ = true;
+            asio::post(stream_.get_executor(),
+                       [this, sg = this->shared_from_this()]() {
+                           this->schedule_flush();
+                       });
+            addon_->kickIo();
+        }
+        return false;
     }
 
-    void post(const std::string &ev,
-              const std::unordered_map<std::string, std::string> &params) {
-        std::string msg = to_json_str(ev, params);
+    void post(const std::string &ev, nlohmann::json params) {
         std::unique_lock lg{mut_};
-        msgs_.emplace_back(msg);
+        msgs_.push_back(message{ev, std::move(params)});
 
         if (!sending_) {
             asio::post(
                 stream_.get_executor(),
                 [this, sg = this->shared_from_this()]() { this->do_send(); });
+            addon_->kickIo();
         }
     }
 
+    void schedule_flush() {
+        std::unique_lock lg{mut_};
+        auto delay = throttle_.wait_time();
+        flushTimer_.expires_after(delay);
+        addon_->wakeIoAfter(delay);
+        flushTimer_.async_wait([this, sg = this->shared_from_this()](
+                                   boost::system::error_code ec) {
+            if (!ec) {
+                this->flush_coalesced();
+            }
+        });
+    }
+
+    void flush_coalesced() {
+        std::vector<dirty_key> due;
+        bool remaining;
+        {
+            std::unique_lock lg{mut_};
+            while (!dirty_.empty() && throttle_.acquire()) {
+                due.push_back(dirty_.extract(dirty_.begin()).value());
+            }
+            remaining = !dirty_.empty();
+            flushing_ = remaining;
+        }
+        if (remaining) {
+            schedule_flush();
+        }
+        if (due.empty()) {
+            return;
+        }
+        addon_->postToMainLoop(
+            [self = this->shared_from_this(), due = std::move(due)]() {
+                if (self->ended_) {
+                    return;
+                }
+                auto &icManager =
+                    self->addon_->instance()->inputContextManager();
+                for (const auto &[ev, uuid] : due) {
+                    auto *ic = icManager.findByUUID(uuid);
+                    if (!ic) {
+                        continue;
+                    }
+                    nlohmann::json params;
+                    {
+                        TraceSpan span{self->addon_->tracer(),
+                                       "extract_params"};
+                        params = extract_ic_state(ev_map().at(ev).type, ic);
+                    }
+                    if (!params.is_null()) {
+                        self->post(ev, std::move(params));
+                    }
+                }
+            });
+    }
+
     void do_send() {
         std::unique_lock lg{mut_};
         if (sending_)
             return;
         if (msgs_.size() && stream_.is_open()) {
-            msg_ = msgs_.front();
+            auto msg = std::move(msgs_.front());
             msgs_.pop_front();
             sending_ = true;
+            lg.unlock();
+            // Serialize only when the message is actually sent.
+            TraceSpan span{addon_->tracer(), "serialize_event"};
+            msg_ = to_json_str(msg.event, msg.params);
         } else {
             return;
         }
         stream_.async_write(asio::buffer(msg_),
-                            [this, sg = this->shared_from_this()](
+                            [this, sg = this->shared_from_this(),
+                             io = pumpWatch_.track(IOEventFlag::Out),
+                             start = Tracer::now()](
                                 boost::system::error_code ec, size_t sz) {
+                                this->addon_->tracer().record(
+                                    "ws_write", start, Tracer::now() - start);
                                 this->send_done(ec, sz);
                             });
     }
@@ -207,24 +581,33 @@ private:
         msg_.clear();
         if (ec) {
             FCITX_ERROR() << "ws send: " << ec.message();
+            end_session();
+            return;
+        }
+        {
+            std::unique_lock lg{mut_};
+            sending_ = false;
         }
-        sending_ = false;
         do_send();
     }
 
     void do_recv() {
         stream_.async_read(buffer_,
-                           [this, sg = this->shared_from_this()](
+                           [this, sg = this->shared_from_this(),
+                            io = pumpWatch_.track(IOEventFlag::In)](
                                boost::system::error_code ec, size_t sz) {
                                this->recv_done(ec, sz);
                            });
     }
 
     void recv_done(boost::system::error_code ec, size_t sz) {
-        if (ec == websocket::error::closed)
+        if (ec == websocket::error::closed) {
+            end_session();
             return;
+        }
         if (ec) {
             FCITX_ERROR() << "ws recv: " << ec.message();
+            end_session();
             return;
         }
         buffer_.consume(sz);
@@ -232,24 +615,182 @@ private:
     }
 
     std::mutex mut_;
-    std::list<std::string> msgs_;
+    std::list<message> msgs_;
     bool sending_ = false;
 
     std::string msg_;
     beast::flat_buffer buffer_{8192};
 
+    // Event names to watch, and their watchers on the main loop.
+    std::vector<std::string> evnames_;
     std::vector<std::unique_ptr<HandlerTableEntry<EventHandler>>>
         eventWatchers_;
+    std::atomic<bool> ended_{false};
     Stream stream_;
     WebServer *addon_;
+
+    event_throttle throttle_;
+    // Wakes the main loop for this socket in threadless mode.
+    IoPump::Watch pumpWatch_;
+    // Event and input context of the state updates not sent yet.
+    using dirty_key = std::pair<std::string, ICUUID>;
+    std::set<dirty_key> dirty_;
+    bool flushing_ = false;
+    asio::steady_timer flushTimer_;
+
+    AdmissionControl::Slot connectionSlot_;
+    AdmissionControl::Slot subscriptionSlot_;
+};
+
+// Streams every config as one json object with chunked transfer encoding,
+// e.g. {"global": {...}, "addon/webserver": {...}, ...}.
+//
+// Configs are captured on the main loop in slices bounded by
+// ExportSliceBudget, and each slice is converted and written before the
+// next one is captured, so memory and main loop stalls stay bounded.
+template <class Socket>
+class config_export
+    : public std::enable_shared_from_this<config_export<Socket>> {
+public:
+    config_export(Socket socket, WebServer *addon, unsigned version,
+                  AdmissionControl::Slot slot)
+        : socket_(std::move(socket)), addon_(addon), slot_(std::move(slot)),
+          pumpWatch_(addon->watchIo(socket_.native_handle())) {
+        header_.version(version);
+        header_.result(http::status::ok);
+        header_.keep_alive(false);
+        header_.set(http::field::server, "WebServer");
+        header_.set(http::field::content_type, "application/json");
+        header_.chunked(true);
+    }
+
+    void start() {
+        arm_deadline();
+        http::async_write_header(
+            socket_, serializer_,
+            [self = this->shared_from_this(),
+             io = pumpWatch_.track(IOEventFlag::Out)](beast::error_code ec,
+                                                      std::size_t) {
+                self->deadline_.cancel();
+                if (ec) {
+                    FCITX_ERROR() << "config export: " << ec.message();
+                    return;
+                }
+                self->addon_->postToMainLoop([self]() {
+                    self->uris_ = listConfigUris(self->addon_->instance());
+                    self->capture_slice();
+                });
+            });
+    }
+
+private:
+    static constexpr std::chrono::microseconds ExportSliceBudget{2000};
+
+    using Slice = std::vector<std::pair<std::string, CapturedConfig>>;
+
+    // A peer that stops reading would keep its slot forever.
+    void arm_deadline() {
+        deadline_.expires_after(addon_->readTimeout());
+        addon_->wakeIoAfter(addon_->readTimeout());
+        deadline_.async_wait(
+            [weak = std::weak_ptr<config_export>(this->shared_from_this())](
+                beast::error_code ec) {
+                auto self = weak.lock();
+                if (!ec && self) {
+                    self->socket_.close(ec);
+                }
+            });
+    }
+
+    // Runs on the main loop.
+    void capture_slice() {
+        TraceSpan span{addon_->tracer(), "config_export_capture"};
+        Slice slice;
+        auto deadline = std::chrono::steady_clock::now() + ExportSliceBudget;
+        do {
+            if (next_ == uris_.size()) {
+                break;
+            }
+            const auto &uri = uris_[next_++];
+            slice.emplace_back(
+                uri.substr(sizeof("fcitx://config/") - 1),
+                captureInstanceConfig(uri, addon_->instance()));
+        } while (std::chrono::steady_clock::now() < deadline);
+        asio::post(socket_.get_executor(),
+                   [self = this->shared_from_this(),
+                    slice = std::move(slice)]() { self->write_slice(slice); });
+    }
+
+    void write_slice(const Slice &slice) {
+        TraceSpan span{addon_->tracer(), "config_export_serialize"};
+        bool last = next_ == uris_.size();
+        chunk_.clear();
+        for (const auto &[key, captured] : slice) {
+            chunk_ += first_ ? "{" : ",";
+            first_ = false;
+            chunk_ += nlohmann::json(key).dump();
+            chunk_ += ":";
+            chunk_ += capturedConfigToJson(captured);
+        }
+        if (last) {
+            chunk_ += first_ ? "{}" : "}";
+        }
+        arm_deadline();
+        asio::async_write(
+            socket_, http::make_chunk(asio::buffer(chunk_)),
+            [self = this->shared_from_this(), last,
+             io = pumpWatch_.track(IOEventFlag::Out)](beast::error_code ec,
+                                                      std::size_t) {
+                self->deadline_.cancel();
+                if (ec) {
+                    FCITX_ERROR() << "config export: " << ec.message();
+                    return;
+                }
+                if (last) {
+                    self->finish();
+                } else {
+                    self->addon_->postToMainLoop(
+                        [self]() { self->capture_slice(); });
+                }
+            });
+    }
+
+    void finish() {
+        arm_deadline();
+        asio::async_write(socket_, http::make_chunk_last(),
+                          [self = this->shared_from_this(),
+                           io = pumpWatch_.track(IOEventFlag::Out)](
+                              beast::error_code ec, std::size_t) {
+                              self->deadline_.cancel();
+                              self->socket_.shutdown(Socket::shutdown_send,
+                                                     ec);
+                          });
+    }
+
+    Socket socket_;
+    WebServer *addon_;
+    AdmissionControl::Slot slot_;
+    IoPump::Watch pumpWatch_;
+    // Closes the socket if a write does not complete in time.
+    asio::steady_timer deadline_{socket_.get_executor()};
+    http::response<http::empty_body> header_;
+    http::response_serializer<http::empty_body> serializer_{header_};
+    // Only touched by one thread at a time, handed over through the job
+    // queue and asio::post.
+    std::vector<std::string> uris_;
+    size_t next_ = 0;
+    bool first_ = true;
+    std::string chunk_;
 };
 
 template <class Socket>
 class http_connection
     : public std::enable_shared_from_this<http_connection<Socket>> {
 public:
-    http_connection(Socket socket, WebServer *addon)
-        : socket_(std::move(socket)), addon_(addon) {}
+    http_connection(Socket socket, WebServer *addon,
+                    AdmissionControl::Slot slot)
+        : socket_(std::move(socket)), addon_(addon), slot_(std::move(slot)),
+          pumpWatch_(addon->watchIo(socket_.native_handle())) {}
 
     // Initiate the asynchronous operations associated with the connection.
     void start() { read_request(); }
@@ -261,6 +802,9 @@ private:
     // The buffer for performing reads.
     beast::flat_buffer buffer_{8192};
 
+    // Parses the request, with the body size limited.
+    http::request_parser<http::string_body> parser_;
+
     // The request message.
     http::request<http::string_body> request_;
 
@@ -270,12 +814,31 @@ private:
     // The addon.
     WebServer *addon_;
 
-    void handle_subscribe(bool upgrade = true) && {
+    // Counts this connection against the limit.
+    AdmissionControl::Slot slot_;
+
+    // Wakes the main loop for this socket in threadless mode.
+    IoPump::Watch pumpWatch_;
+
+    // Closes the socket if the request is not read, or the response not
+    // written, in time.
+    asio::steady_timer deadline_{socket_.get_executor()};
+
+    void handle_subscribe(AdmissionControl::Slot subscriptionSlot,
+                          bool upgrade = true) && {
+        std::string_view target{request_.target()};
+        std::string_view query;
+        if (auto pos = target.find('?'); pos != std::string_view::npos) {
+            query = target.substr(pos + 1);
+            target = target.substr(0, pos);
+        }
         auto ws = std::make_shared<ws_subscription<websocket::stream<Socket>>>(
-            websocket::stream<Socket>{std::move(socket_)}, addon_);
+            websocket::stream<Socket>{std::move(socket_)}, addon_,
+            throttle_options::parse(query), std::move(slot_),
+            std::move(subscriptionSlot));
         if (upgrade) {
-            if (request_.target().starts_with("/subscribe/")) {
-                std::string_view sv{request_.target()};
+            if (target.starts_with("/subscribe/")) {
+                std::string_view sv{target};
                 sv.remove_prefix(11);
                 auto it = sv.begin();
                 auto beg = it;
@@ -304,19 +867,54 @@ private:
         }
     }
 
+    void arm_deadline() {
+        deadline_.expires_after(addon_->readTimeout());
+        addon_->wakeIoAfter(addon_->readTimeout());
+        deadline_.async_wait(
+            [weak = std::weak_ptr<http_connection>(this->shared_from_this())](
+                beast::error_code ec) {
+                auto self = weak.lock();
+                if (!ec && self) {
+                    self->socket_.close(ec);
+                }
+            });
+    }
+
     // Asynchronously receive a complete request message.
     void read_request() {
         auto self = this->shared_from_this();
 
+        arm_deadline();
+        parser_.body_limit(addon_->maxBodySize());
         http::async_read(
-            socket_, buffer_, request_,
-            [self](beast::error_code ec, std::size_t bytes_transferred) {
+            socket_, buffer_, parser_,
+            [self, io = pumpWatch_.track(IOEventFlag::In),
+             start = Tracer::now()](beast::error_code ec,
+                                    std::size_t bytes_transferred) {
                 boost::ignore_unused(bytes_transferred);
-                if (!ec)
+                // Includes waiting for the client to send the request.
+                self->addon_->tracer().record("http_read", start,
+                                              Tracer::now() - start);
+                self->deadline_.cancel();
+                if (ec == http::error::body_limit) {
+                    self->reject_body();
+                } else if (!ec) {
+                    self->request_ = self->parser_.release();
                     self->process_request();
+                }
             });
     }
 
+    void reject_body() {
+        request_.base() = parser_.get().base();
+        response_.version(request_.version());
+        response_.keep_alive(false);
+        response_.result(http::status::payload_too_large);
+        response_.set(http::field::content_type, "text/plain");
+        beast::ostream(response_.body()) << "Request body too large\r\n";
+        write_response();
+    }
+
     // Determine what needs to be done with the request message.
     void process_request() {
         response_.version(request_.version());
@@ -324,7 +922,24 @@ private:
 
         if (request_.target().starts_with("/subscribe") &&
             websocket::is_upgrade(request_)) {
-            std::move(*this).handle_subscribe();
+            if (auto slot = addon_->admission().tryAcquireSubscription()) {
+                std::move(*this).handle_subscribe(std::move(slot));
+                return;
+            }
+            response_.result(http::status::service_unavailable);
+            response_.set(http::field::content_type, "text/plain");
+            beast::ostream(response_.body()) << "Too many subscriptions\r\n";
+            write_response();
+            return;
+        }
+
+        if (request_.method() == http::verb::get &&
+            request_.target() == "/config/all") {
+            std::make_shared<config_export<Socket>>(
+                std::move(socket_), addon_, request_.version(),
+                std::move(slot_))
+                ->start();
+            FCITX_INFO() << "200 GET /config/all";
             return;
         }
 
@@ -368,12 +983,48 @@ private:
                 beast::ostream(response_.body())
                     << addon_->routedGetConfig(uri.c_str());
             } else if (request_.method() == http::verb::post) {
+                // Parsed here, only the result is handed to the main loop.
+                RawConfig config;
+                std::string error;
+                bool parsed;
+                {
+                    TraceSpan span{addon_->tracer(), "parse_config_json"};
+                    parsed = parseConfigJson(request_.body().data(),
+                                             request_.body().size(), config,
+                                             error);
+                }
+                if (!parsed) {
+                    response_.result(http::status::bad_request);
+                    response_.set(http::field::content_type,
+                                  "application/json");
+                    beast::ostream(response_.body())
+                        << nlohmann::json{{"ERROR", error}}.dump();
+                    return;
+                }
                 response_.result(http::status::ok);
                 response_.set(http::field::content_type, "application/json");
-                beast::ostream(response_.body()) << addon_->routedSetConfig(
-                    uri.c_str(), request_.body().data(),
-                    request_.body().size());
+                beast::ostream(response_.body())
+                    << addon_->routedSetConfig(uri, config);
             }
+        } else if (request_.target() == "/trace" &&
+                   request_.method() == http::verb::get) {
+            response_.result(http::status::ok);
+            response_.set(http::field::content_type, "application/json");
+            beast::ostream(response_.body())
+                << addon_->tracer().dumpChromeTrace();
+        } else if (request_.target() == "/stats") {
+            auto &admission = addon_->admission();
+            response_.result(http::status::ok);
+            response_.set(http::field::content_type, "application/json");
+            beast::ostream(response_.body())
+                << nlohmann::json{
+                       {"connections", admission.connections()},
+                       {"max_connections", admission.maxConnections()},
+                       {"subscriptions", admission.subscriptions()},
+                       {"max_subscriptions", admission.maxSubscriptions()},
+                       {"rejected", admission.rejected()},
+                   }
+                       .dump();
         } else if (request_.target().starts_with("/controller/")) {
             std::string s = request_.target().substr(12);
             response_.result(http::status::ok);
@@ -393,8 +1044,14 @@ private:
 
         response_.content_length(response_.body().size());
 
+        arm_deadline();
         http::async_write(socket_, response_,
-                          [self](beast::error_code ec, std::size_t) {
+                          [self, io = pumpWatch_.track(IOEventFlag::Out),
+                           start = Tracer::now()](beast::error_code ec,
+                                                  std::size_t) {
+                              self->addon_->tracer().record(
+                                  "http_write", start, Tracer::now() - start);
+                              self->deadline_.cancel();
                               self->socket_.shutdown(Socket::shutdown_send, ec);
                           });
         FCITX_INFO() << response_.result_int() << " "
@@ -402,58 +1059,338 @@ private:
     }
 };
 
-// "Loop" forever accepting new connections.
-template <class Acceptor, class Socket>
-void http_server(Acceptor &acceptor, Socket &socket, WebServer *addon) {
-    acceptor.async_accept(socket, [&acceptor, &socket,
-                                   addon](beast::error_code ec) {
-        if (!ec)
-            std::make_shared<http_connection<Socket>>(std::move(socket), addon)
-                ->start();
-        http_server(acceptor, socket, addon);
-    });
-}
+// Accepts connections until stopped, connections already accepted are not
+// affected by stop().
+template <class Protocol>
+class http_listener
+    : public Listener,
+      public std::enable_shared_from_this<http_listener<Protocol>> {
+public:
+    using Socket = typename Protocol::socket;
 
-void WebServer::startServer() {
-    ioc = std::make_shared<asio::io_context>();
+    http_listener(asio::io_context &ioc,
+                  const typename Protocol::endpoint &ep, WebServer *addon)
+        : acceptor_(ioc, ep), socket_(ioc), backoffTimer_(ioc),
+          addon_(addon) {
+        openReserveFd();
+        pumpWatch_ = addon_->watchIo(acceptor_.native_handle());
+    }
+
+    // Takes over an already listening socket.
+    http_listener(asio::io_context &ioc, const Protocol &protocol, int fd,
+                  WebServer *addon)
+        : acceptor_(ioc, protocol, fd), socket_(ioc), backoffTimer_(ioc),
+          addon_(addon) {
+        openReserveFd();
+        pumpWatch_ = addon_->watchIo(fd);
+    }
 
+    ~http_listener() {
+        if (reserveFd_ >= 0) {
+            ::close(reserveFd_);
+        }
+    }
+
+    void start() { do_accept(); }
+
+    void stop() override {
+        // Do not keep the socket open through the watcher's duplicate fd.
+        pumpWatch_ = {};
+        beast::error_code ec;
+        acceptor_.close(ec);
+        backoffTimer_.cancel();
 #ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
-    if (config_.communication.value() == WebServerCommunication::UnixSocket) {
-        auto path = config_.unix_socket.value().path.value();
-        (void)::unlink(path.c_str());
-        auto const ep = asio::local::stream_protocol::endpoint{path};
-        asio::local::stream_protocol::acceptor acceptor{*ioc, ep};
-        asio::local::stream_protocol::socket socket{*ioc};
-        http_server(acceptor, socket, this);
-        ioc->run();
-    } else {
+        if (!socketPath_.empty()) {
+            (void)::unlink(socketPath_.c_str());
+        }
 #endif
-        auto const address = asio::ip::make_address("127.0.0.1");
-        tcp::acceptor acceptor{
-            *ioc, {address, (unsigned short)config_.tcp.value().port.value()}};
-        tcp::socket socket{*ioc};
-        http_server(acceptor, socket, this);
-        ioc->run();
+    }
+
+    // Unix socket file to remove once stopped.
+    void set_socket_path(std::string path) { socketPath_ = std::move(path); }
+
+private:
+    static constexpr std::chrono::milliseconds MinBackoff{10};
+    static constexpr std::chrono::milliseconds MaxBackoff{1000};
+
+    void do_accept() {
+        acceptor_.async_accept(socket_, [self = this->shared_from_this(),
+                                         io = pumpWatch_.track(
+                                             IOEventFlag::In)](
+                                            beast::error_code ec) {
+            if (!self->acceptor_.is_open()) {
+                return;
+            }
+            if (ec) {
+                self->accept_failed(ec);
+                return;
+            }
+            TraceSpan span{self->addon_->tracer(), "accept"};
+            self->backoff_ = std::chrono::milliseconds::zero();
+            if (auto slot = self->addon_->admission().tryAcquireConnection()) {
+                std::make_shared<http_connection<Socket>>(
+                    std::move(self->socket_), self->addon_, std::move(slot))
+                    ->start();
+            } else {
+                reject(std::move(self->socket_));
+            }
+            self->do_accept();
+        });
+    }
+
+    // Out of fds or another persistent error: the pending connection stays
+    // in the backlog, so re-arming right away would spin. Shed one
+    // connection using the reserve fd and wait before accepting again.
+    void accept_failed(beast::error_code ec) {
+        FCITX_WARN() << "WebServer accept: " << ec.message();
+        if (ec == asio::error::no_descriptors ||
+            ec == boost::system::errc::too_many_files_open_in_system) {
+            shed();
+        }
+        backoff_ = std::clamp(backoff_ * 2, MinBackoff, MaxBackoff);
+        backoffTimer_.expires_after(backoff_);
+        // Nothing else may poll a threadless server with no connections.
+        addon_->wakeIoAfter(backoff_);
+        backoffTimer_.async_wait(
+            [self = this->shared_from_this()](beast::error_code ec) {
+                if (!ec && self->acceptor_.is_open()) {
+                    self->do_accept();
+                }
+            });
+    }
+
+    void shed() {
+        if (reserveFd_ < 0) {
+            return;
+        }
+        ::close(reserveFd_);
+        reserveFd_ = -1;
+        beast::error_code ec;
+        acceptor_.non_blocking(true, ec);
+        Socket victim{acceptor_.get_executor()};
+        acceptor_.accept(victim, ec);
+        victim.close(ec);
+        openReserveFd();
+    }
+
+    void openReserveFd() {
+        reserveFd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    // Tell the client to come back later, without reading its request.
+    static void reject(Socket socket) {
+        static const std::string response =
+            "HTTP/1.1 503 Service Unavailable\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: 22\r\n"
+            "Connection: close\r\n"
+            "\r\n"
+            "Too many connections\r\n";
+        auto sock = std::make_shared<Socket>(std::move(socket));
+        asio::async_write(*sock, asio::buffer(response),
+                          [sock](beast::error_code ec, std::size_t) {
+                              sock->shutdown(Socket::shutdown_send, ec);
+                          });
+    }
+
+    typename Protocol::acceptor acceptor_;
+    Socket socket_;
+    asio::steady_timer backoffTimer_;
+    std::chrono::milliseconds backoff_{0};
+    // Kept open to be given up for shedding a connection when out of fds.
+    int reserveFd_ = -1;
+    WebServer *addon_;
+    std::string socketPath_;
+    IoPump::Watch pumpWatch_;
+};
+
 #ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+// Wraps an already listening socket, nullptr if its family is not supported.
+std::shared_ptr<Listener> adoptListener(asio::io_context &ioc, int fd,
+                                        const std::string &socketPath,
+                                        WebServer *addon) {
+    switch (socketFamily(fd)) {
+    case AF_UNIX: {
+        auto l = std::make_shared<http_listener<asio::local::stream_protocol>>(
+            ioc, asio::local::stream_protocol(), fd, addon);
+        l->set_socket_path(socketPath);
+        l->start();
+        return l;
     }
+    case AF_INET:
+    case AF_INET6: {
+        auto l = std::make_shared<http_listener<tcp>>(
+            ioc, socketFamily(fd) == AF_INET ? tcp::v4() : tcp::v6(), fd,
+            addon);
+        l->start();
+        return l;
+    }
+    default:
+        return nullptr;
+    }
+}
 #endif
+
+std::string WebServer::configuredListenKey() const {
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+    if (config_.communication.value() == WebServerCommunication::UnixSocket) {
+        return "unix:" + config_.unix_socket.value().path.value();
+    }
+#endif
+    return "tcp:" + std::to_string(config_.tcp.value().port.value());
 }
 
-void WebServer::startThread() {
-    serverThread_ = std::thread([this] {
+void WebServer::updateListener() {
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+    if (!inheritedFds_.empty()) {
+        if (listenKey_ == InheritedListenKey) {
+            // The addresses are owned by the service manager.
+            return;
+        }
+        listenKey_ = InheritedListenKey;
+        // Listeners close their socket when dropped, keep the inherited ones
+        // open for when the server restarts.
+        std::vector<int> fds;
+        for (int fd : inheritedFds_) {
+            int dupFd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+            if (dupFd < 0) {
+                FCITX_ERROR() << "WebServer: cannot use socket " << fd << ": "
+                              << std::strerror(errno);
+                continue;
+            }
+            fds.push_back(dupFd);
+        }
+        adoptListeners(std::move(fds), "");
+        return;
+    }
+    if (!adoptFds_.empty()) {
+        listenKey_ = adoptKey_;
+        // Sockets we bound ourselves are removed when stopped.
+        std::string socketPath;
+        if (stringutils::startsWith(adoptKey_, "unix:")) {
+            socketPath = adoptKey_.substr(5);
+        }
+        adoptListeners(std::exchange(adoptFds_, {}), socketPath);
+        // The listeners own the sockets now, bind again for the next lazy
+        // start.
+        adoptKey_.clear();
+        return;
+    }
+#endif
+    auto communication = config_.communication.value();
+    auto path = config_.unix_socket.value().path.value();
+    auto port = static_cast<unsigned short>(config_.tcp.value().port.value());
+    auto key = configuredListenKey();
+    if (key == listenKey_) {
+        // Nothing to rebind, keep the listener and all the sessions.
+        return;
+    }
+    listenKey_ = key;
+
+    asio::post(*ioc, [this, communication, path, port]() {
+        std::shared_ptr<Listener> listener;
         try {
-            startServer();
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+            if (communication == WebServerCommunication::UnixSocket) {
+                (void)::unlink(path.c_str());
+                auto l = std::make_shared<
+                    http_listener<asio::local::stream_protocol>>(
+                    *ioc, asio::local::stream_protocol::endpoint{path}, this);
+                l->set_socket_path(path);
+                l->start();
+                listener = l;
+            } else {
+#endif
+                auto const address = asio::ip::make_address("127.0.0.1");
+                auto l = std::make_shared<http_listener<tcp>>(
+                    *ioc, tcp::endpoint{address, port}, this);
+                l->start();
+                listener = l;
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+            }
+#endif
         } catch (const std::exception &e) {
             FCITX_ERROR() << "Error in WebServer: " << e.what();
+            // Keep the old listener, and retry on next reload.
+            jobQueue_.push([this]() { listenKey_.clear(); });
+            return;
+        }
+        // The old listeners only stop accepting, their connections drain on
+        // their own.
+        for (auto &old : listeners_) {
+            old->stop();
+        }
+        listeners_.clear();
+        listeners_.push_back(std::move(listener));
+    });
+    kickIo();
+}
+
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+void WebServer::adoptListeners(std::vector<int> fds, std::string socketPath) {
+    asio::post(*ioc, [this, fds = std::move(fds),
+                      socketPath = std::move(socketPath)]() {
+        for (int fd : fds) {
+            std::shared_ptr<Listener> listener;
+            try {
+                listener = adoptListener(*ioc, fd, socketPath, this);
+            } catch (const std::exception &e) {
+                FCITX_ERROR() << "Error in WebServer: " << e.what();
+            }
+            if (listener) {
+                listeners_.push_back(std::move(listener));
+            } else {
+                FCITX_ERROR() << "WebServer: cannot use socket " << fd;
+                ::close(fd);
+            }
+        }
+    });
+    kickIo();
+}
+#endif
+
+void WebServer::startThread() {
+    ioc = std::make_shared<asio::io_context>();
+    if (threadless_) {
+        pump_ = std::make_unique<IoPump>(instance_->eventLoop(), *ioc);
+        return;
+    }
+    work_.emplace(ioc->get_executor());
+    serverThread_ = std::thread([ioc = ioc] {
+        for (;;) {
+            try {
+                ioc->run();
+                break;
+            } catch (const std::exception &e) {
+                FCITX_ERROR() << "Error in WebServer: " << e.what();
+            }
         }
     });
 }
 
 void WebServer::stopThread() {
+    // The server thread may be waiting in runOnMainLoop for a job queued
+    // behind us, and queued jobs may hold sessions watched by the pump. Fail
+    // and drop them instead.
+    jobQueue_.shutdown();
     if (this->serverThread_.joinable()) {
+        work_.reset();
         ioc->stop();
         serverThread_.join();
     }
+    // Handlers left in the io_context may keep them alive, close the
+    // sockets now so that the address can be bound again.
+    for (auto &listener : listeners_) {
+        listener->stop();
+    }
+    listeners_.clear();
+    listenKey_.clear();
+    if (pump_) {
+        // Destroys the sessions, which release their watches on the pump.
+        ioc.reset();
+        pump_.reset();
+    }
+    jobQueue_.reopen();
 }
 } // namespace fcitx
 
@@ -12,13 +12,37 @@
 #include <fcitx/addoninstance.h>
 #include <fcitx/addonmanager.h>
 #include <fcitx/instance.h>
+#include <future>
+#include <optional>
 #include <thread>
 
+#include "controller/state_snapshot.h"
+#include "mainloop/io_pump.h"
+#include "mainloop/job_queue.h"
+#include "server/admission.h"
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+#include "shm/event_ring_writer.h"
+#endif
+#include "trace/tracer.h"
+
 namespace asio = boost::asio;
 
 // fcitx in numpad
 #define DEFAULT_PORT 32489
 #define DEFAULT_UNIX_SOCKET_PATH "/tmp/fcitx5.sock"
+#define DEFAULT_MAX_CONNECTIONS 64
+#define DEFAULT_MAX_SUBSCRIPTIONS 32
+// In KiB
+#define DEFAULT_MAX_BODY_SIZE 1024
+// In seconds
+#define DEFAULT_READ_TIMEOUT 30
+#define DEFAULT_HANDSHAKE_TIMEOUT 10
+#define DEFAULT_WEBSOCKET_IDLE_TIMEOUT 60
+// Empty for $XDG_RUNTIME_DIR/fcitx5-events
+#define DEFAULT_EVENT_RING_PATH ""
+#define DEFAULT_EVENT_RING_SLOTS 1024
+// In bytes
+#define DEFAULT_EVENT_RING_SLOT_SIZE 4096
 
 namespace fcitx {
 
@@ -31,12 +55,55 @@ FCITX_CONFIGURATION(WebServerUnixSocketConfig,
                     Option<std::string> path{this, "Path", _("Path"),
                                              DEFAULT_UNIX_SOCKET_PATH};);
 
+FCITX_CONFIGURATION(
+    WebServerLimitsConfig,
+    Option<int, IntConstrain> maxConnections{this, "Max Connections",
+                                             _("Max Connections"),
+                                             DEFAULT_MAX_CONNECTIONS,
+                                             IntConstrain(1, 4096)};
+    Option<int, IntConstrain> maxSubscriptions{this, "Max Subscriptions",
+                                               _("Max Subscriptions"),
+                                               DEFAULT_MAX_SUBSCRIPTIONS,
+                                               IntConstrain(0, 4096)};
+    Option<int, IntConstrain> maxBodySize{this, "Max Body Size",
+                                          _("Max Body Size (KiB)"),
+                                          DEFAULT_MAX_BODY_SIZE,
+                                          IntConstrain(1, 65536)};);
+
+FCITX_CONFIGURATION(
+    WebServerTimeoutsConfig,
+    Option<int, IntConstrain> read{this, "Read", _("Read and Write (seconds)"),
+                                   DEFAULT_READ_TIMEOUT,
+                                   IntConstrain(1, 3600)};
+    Option<int, IntConstrain> handshake{this, "Handshake",
+                                        _("WebSocket Handshake (seconds)"),
+                                        DEFAULT_HANDSHAKE_TIMEOUT,
+                                        IntConstrain(1, 3600)};
+    Option<int, IntConstrain> webSocketIdle{
+        this, "WebSocket Idle", _("WebSocket Idle (seconds)"),
+        DEFAULT_WEBSOCKET_IDLE_TIMEOUT, IntConstrain(2, 3600)};);
+
+FCITX_CONFIGURATION(
+    WebServerEventRingConfig,
+    Option<bool> enabled{this, "Enabled", _("Enabled"), false};
+    Option<std::string> path{this, "Path", _("Path"), DEFAULT_EVENT_RING_PATH};
+    Option<int, IntConstrain> slots{this, "Slots", _("Slots"),
+                                    DEFAULT_EVENT_RING_SLOTS,
+                                    IntConstrain(16, 1 << 20)};
+    Option<int, IntConstrain> slotSize{this, "Slot Size",
+                                       _("Slot Size (bytes)"),
+                                       DEFAULT_EVENT_RING_SLOT_SIZE,
+                                       IntConstrain(64, 1 << 20)};);
+
 FCITX_CONFIG_ENUM(WebServerCommunication,
 #ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
                   UnixSocket,
 #endif
                   Tcp);
 
+// Where the sockets are served, MainLoop avoids the hops between threads.
+FCITX_CONFIG_ENUM(WebServerThreading, Thread, MainLoop);
+
 FCITX_CONFIGURATION(WebServerConfig,
                     Option<WebServerCommunication> communication{
                         this, "Communication", _("Communication"),
@@ -48,7 +115,32 @@ FCITX_CONFIGURATION(WebServerConfig,
                     };
                     Option<WebServerTcpConfig> tcp{this, "Tcp", _("Tcp"), {}};
                     Option<WebServerUnixSocketConfig> unix_socket{
-                        this, "Unix Socket", _("Unix Socket"), {}};);
+                        this, "Unix Socket", _("Unix Socket"), {}};
+                    Option<WebServerLimitsConfig> limits{
+                        this, "Limits", _("Limits"), {}};
+                    Option<WebServerTimeoutsConfig> timeouts{
+                        this, "Timeouts", _("Timeouts"), {}};
+                    Option<bool> tracing{this, "Tracing",
+                                         _("Record traces for GET /trace"),
+                                         false};
+                    Option<bool> lazyStart{
+                        this, "Lazy Start",
+                        _("Start the server on the first connection"),
+                        false};
+                    Option<WebServerThreading> threading{
+                        this, "Threading Mode", _("Threading Mode"),
+                        WebServerThreading::Thread};
+                    Option<WebServerEventRingConfig> eventRing{
+                        this, "Event Ring", _("Shared Memory Event Ring"),
+                        {}};);
+
+/// A listening socket of the web server, owned by the server thread.
+class Listener {
+public:
+    virtual ~Listener() = default;
+    /// Stop accepting, established connections are kept.
+    virtual void stop() = 0;
+};
 
 class WebServer : public AddonInstance {
 public:
@@ -56,10 +148,75 @@ public:
     ~WebServer();
 
     Instance *instance() { return instance_; }
+    AdmissionControl &admission() { return admission_; }
+    Tracer &tracer() { return tracer_; }
+
+    /// Queue a job on the main loop without waiting for it.
+    void postToMainLoop(MainLoopJobQueue::Job job) {
+        if (threadless_) {
+            // The job may post back to the io_context.
+            jobQueue_.push([this, job = std::move(job)]() {
+                job();
+                kickIo();
+            });
+            return;
+        }
+        jobQueue_.push(std::move(job));
+    }
+
+    /// Whether the sockets are served on the main loop.
+    bool threadless() const { return threadless_; }
+
+    /// Watch a socket served on the main loop, a no-op handle otherwise.
+    IoPump::Watch watchIo(int fd) {
+        if (!threadless_ || !pump_) {
+            return {};
+        }
+        return pump_->watch(fd);
+    }
+
+    /// Let the main loop poll the io_context after posting to it from the
+    /// main loop, a no-op with a server thread.
+    void kickIo() {
+        if (pump_) {
+            pump_->kick();
+        }
+    }
+
+    /// Poll the io_context once an asio timer armed with delay expires, a
+    /// no-op with a server thread.
+    template <class Duration>
+    void wakeIoAfter(Duration delay) {
+        if (threadless_ && pump_) {
+            pump_->wakeAfter(
+                std::chrono::ceil<std::chrono::microseconds>(delay));
+        }
+    }
+
+    /// Limit of request bodies in bytes, may be read from any thread.
+    uint64_t maxBodySize() const {
+        return static_cast<uint64_t>(maxBodySize_.load()) * 1024;
+    }
+
+    // Timeouts for the sessions, may be read from any thread.
+    std::chrono::seconds readTimeout() const {
+        return std::chrono::seconds(readTimeout_.load());
+    }
+    std::chrono::seconds handshakeTimeout() const {
+        return std::chrono::seconds(handshakeTimeout_.load());
+    }
+    std::chrono::seconds webSocketIdleTimeout() const {
+        return std::chrono::seconds(webSocketIdleTimeout_.load());
+    }
+
+    /// Latest read-only state, may be called from any thread.
+    std::shared_ptr<const StateSnapshot> state() const {
+        return state_.load();
+    }
 
     std::string routedGetConfig(const std::string &uri);
-    std::string routedSetConfig(const std::string &uri, const char *data,
-                                size_t sz);
+    std::string routedSetConfig(const std::string &uri,
+                                const RawConfig &config);
     std::string routedControllerRequest(const std::string &path);
 
     const Configuration *getConfig() const override { return &config_; }
@@ -68,14 +225,87 @@ public:
 
 private:
     static const inline std::string ConfPath = "conf/beast.conf";
+    // listenKey_ of sockets passed by the service manager.
+    static const inline std::string InheritedListenKey = "inherited";
+    // Upper bound of main loop time spent on web requests per iteration.
+    static constexpr std::chrono::microseconds MainLoopSliceBudget{4000};
+
+    // Run f on the main loop and wait for its result.
+    template <class F>
+    auto runOnMainLoop(F f) -> decltype(f()) {
+        if (threadless_) {
+            // Already on the main loop.
+            return f();
+        }
+        auto prom = std::make_shared<std::promise<decltype(f())>>();
+        auto fut = prom->get_future();
+        jobQueue_.push([prom, f = std::move(f)]() {
+            try {
+                prom->set_value(f());
+            } catch (...) {
+                prom->set_exception(std::current_exception());
+            }
+        });
+        return fut.get();
+    }
+
     void startThread();
     void stopThread();
+    bool serverRunning() const { return serverThread_.joinable() || pump_; }
     void startServer();
+    void prepareLazyStart();
+    void updateListener();
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+    void adoptListeners(std::vector<int> fds, std::string socketPath);
+#endif
+    std::string configuredListenKey() const;
+    void watchState();
+    void updateEventRing();
+    void publishState(InputContext *focused);
+    InputContext *focusedInputContext();
     Instance *instance_;
     WebServerConfig config_;
+    Tracer tracer_;
+    // Outlives the io_context, whose sessions hold slots.
+    AdmissionControl admission_;
+    std::atomic<int> maxBodySize_{DEFAULT_MAX_BODY_SIZE};
+    std::atomic<int> readTimeout_{DEFAULT_READ_TIMEOUT};
+    std::atomic<int> handshakeTimeout_{DEFAULT_HANDSHAKE_TIMEOUT};
+    std::atomic<int> webSocketIdleTimeout_{DEFAULT_WEBSOCKET_IDLE_TIMEOUT};
     std::shared_ptr<asio::io_context> ioc;
+    std::optional<asio::executor_work_guard<asio::io_context::executor_type>>
+        work_;
+    // Accessed on the server thread only.
+    std::vector<std::shared_ptr<Listener>> listeners_;
+    // Address currently listened on, e.g. "tcp:32489".
+    std::string listenKey_;
+    // Listening sockets passed by the service manager, kept for the life of
+    // the addon. Listeners get duplicates of them.
+    std::vector<int> inheritedFds_;
+    // Listening socket bound for lazy start before the server starts, and
+    // the listenKey_ it stands for.
+    std::vector<int> adoptFds_;
+    std::string adoptKey_;
+    // Wait for the first connection in lazy start mode.
+    std::vector<std::unique_ptr<EventSourceIO>> lazyWatchers_;
     std::thread serverThread_;
+    // Only changed while the server is stopped.
+    std::atomic<bool> threadless_{false};
+    // Drives ioc in threadless mode, touched on the main loop only.
+    std::unique_ptr<IoPump> pump_;
     fcitx::EventDispatcher dispatcher_;
+    MainLoopJobQueue jobQueue_{dispatcher_, MainLoopSliceBudget, tracer_};
+    StateSnapshotCell state_;
+    std::vector<std::unique_ptr<HandlerTableEntry<EventHandler>>>
+        stateWatchers_;
+#ifdef FCITX5_BEAST_HAS_UNIX_SOCKET
+    // Publishes every subscribable event to local readers, main loop only.
+    std::unique_ptr<EventRingWriter> eventRing_;
+    // Settings the ring was created with, empty if disabled.
+    std::string eventRingKey_;
+    std::vector<std::unique_ptr<HandlerTableEntry<EventHandler>>>
+        eventRingWatchers_;
+#endif
 };
 
 class WebServerFactory : public AddonFactory {